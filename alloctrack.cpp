@@ -0,0 +1,127 @@
+#include "alloctrack.h"
+
+#include <cstdlib>
+#include <new>
+
+namespace
+{
+  thread_local AllocationStats threadStats;
+  AllocationTracker::Hook allocationHook = 0;
+}
+
+bool AllocationTracker::enabled()
+{
+#ifdef FIELDVALUE_TRACK_ALLOCATIONS
+  return true;
+#else
+  return false;
+#endif
+}
+
+AllocationStats AllocationTracker::current()
+{
+  return threadStats;
+}
+
+AllocationTracker::Hook AllocationTracker::setHook(Hook hook)
+{
+  Hook previous = allocationHook;
+  allocationHook = hook;
+  return previous;
+}
+
+void AllocationTracker::recordAllocation(std::size_t bytes)
+{
+  ++threadStats.allocations;
+  threadStats.bytes += bytes;
+  if(allocationHook)
+    allocationHook(bytes);
+}
+
+void AllocationTracker::recordDeallocation()
+{
+  ++threadStats.deallocations;
+}
+
+#ifdef FIELDVALUE_TRACK_ALLOCATIONS
+
+namespace
+{
+  void* trackedAllocate(std::size_t size)
+  {
+    void* p = std::malloc(size ? size : 1);
+    if(!p)
+      throw std::bad_alloc();
+    AllocationTracker::recordAllocation(size);
+    return p;
+  }
+
+  void* trackedAllocateAligned(std::size_t size, std::align_val_t alignment)
+  {
+    std::size_t align = static_cast<std::size_t>(alignment);
+    if(align < sizeof(void*))
+      align = sizeof(void*);
+    void* p = 0;
+    if(posix_memalign(&p, align, size ? size : 1) != 0)
+      throw std::bad_alloc();
+    AllocationTracker::recordAllocation(size);
+    return p;
+  }
+
+  void trackedFree(void* p)
+  {
+    if(!p)
+      return;
+    AllocationTracker::recordDeallocation();
+    std::free(p);
+  }
+}
+
+void* operator new(std::size_t size) { return trackedAllocate(size); }
+void* operator new[](std::size_t size) { return trackedAllocate(size); }
+void operator delete(void* p) noexcept { trackedFree(p); }
+void operator delete[](void* p) noexcept { trackedFree(p); }
+void operator delete(void* p, std::size_t) noexcept { trackedFree(p); }
+void operator delete[](void* p, std::size_t) noexcept { trackedFree(p); }
+
+void* operator new(std::size_t size, std::nothrow_t const&) noexcept
+{
+  try { return trackedAllocate(size); } catch(...) { return 0; }
+}
+
+void* operator new[](std::size_t size, std::nothrow_t const&) noexcept
+{
+  try { return trackedAllocate(size); } catch(...) { return 0; }
+}
+
+void operator delete(void* p, std::nothrow_t const&) noexcept { trackedFree(p); }
+void operator delete[](void* p, std::nothrow_t const&) noexcept { trackedFree(p); }
+
+void* operator new(std::size_t size, std::align_val_t alignment)
+{
+  return trackedAllocateAligned(size, alignment);
+}
+
+void* operator new[](std::size_t size, std::align_val_t alignment)
+{
+  return trackedAllocateAligned(size, alignment);
+}
+
+void* operator new(std::size_t size, std::align_val_t alignment, std::nothrow_t const&) noexcept
+{
+  try { return trackedAllocateAligned(size, alignment); } catch(...) { return 0; }
+}
+
+void* operator new[](std::size_t size, std::align_val_t alignment, std::nothrow_t const&) noexcept
+{
+  try { return trackedAllocateAligned(size, alignment); } catch(...) { return 0; }
+}
+
+void operator delete(void* p, std::align_val_t) noexcept { trackedFree(p); }
+void operator delete[](void* p, std::align_val_t) noexcept { trackedFree(p); }
+void operator delete(void* p, std::size_t, std::align_val_t) noexcept { trackedFree(p); }
+void operator delete[](void* p, std::size_t, std::align_val_t) noexcept { trackedFree(p); }
+void operator delete(void* p, std::align_val_t, std::nothrow_t const&) noexcept { trackedFree(p); }
+void operator delete[](void* p, std::align_val_t, std::nothrow_t const&) noexcept { trackedFree(p); }
+
+#endif
@@ -0,0 +1,99 @@
+// -*- c++ -*-
+#ifndef ALLOCTRACK_H
+#define ALLOCTRACK_H
+
+#include <cstddef>
+#include <ostream>
+#include <streambuf>
+
+/*
+ * Heap allocation accounting for the field/queue stack.
+ *
+ * Counting is only active when the program is built with
+ * FIELDVALUE_TRACK_ALLOCATIONS defined; alloctrack.cpp then replaces the
+ * global operator new/delete and reports every allocation of the calling
+ * thread here.  Without it all counters stay at zero and enabled() is false.
+ */
+struct AllocationStats
+{
+    AllocationStats()
+    :allocations(0), deallocations(0), bytes(0)
+    {
+    }
+
+    std::size_t allocations;
+    std::size_t deallocations;
+    std::size_t bytes;
+};
+
+class AllocationTracker
+{
+public:
+    typedef void (*Hook)(std::size_t bytes);
+
+    static bool enabled();
+
+    // counters of the calling thread since it started
+    static AllocationStats current();
+
+    // called for every tracked allocation, after the counters were updated;
+    // the hook must not allocate itself.  Returns the previous hook.
+    static Hook setHook(Hook hook);
+
+    static void recordAllocation(std::size_t bytes);
+    static void recordDeallocation();
+};
+
+/*
+ * Counts the allocations of the calling thread between construction
+ * and stats().
+ */
+class AllocationScope
+{
+public:
+    AllocationScope()
+    :start(AllocationTracker::current())
+    {
+    }
+
+    AllocationStats stats() const
+    {
+        AllocationStats now = AllocationTracker::current();
+        now.allocations -= start.allocations;
+        now.deallocations -= start.deallocations;
+        now.bytes -= start.bytes;
+        return now;
+    }
+
+private:
+    AllocationStats start;
+};
+
+/*
+ * A stream buffer that swallows everything, so that measuring serializeTo()
+ * does not count the allocations of the output stream itself.
+ */
+class NullStreamBuf : public std::streambuf
+{
+protected:
+    int_type overflow(int_type c) { return traits_type::not_eof(c); }
+    std::streamsize xsputn(const char*, std::streamsize n) { return n; }
+};
+
+template<typename Tree>
+AllocationStats allocationsPerUpdate(Tree& tree)
+{
+    AllocationScope scope;
+    tree.update();
+    return scope.stats();
+}
+
+template<typename Tree>
+AllocationStats allocationsPerSerialize(Tree& tree, std::ostream& output)
+{
+    AllocationScope scope;
+    tree.serializeTo(output);
+    return scope.stats();
+}
+
+#endif
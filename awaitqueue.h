@@ -0,0 +1,240 @@
+// -*- c++ -*-
+#ifndef AWAITQUEUE_H
+#define AWAITQUEUE_H
+
+#include "dataqueue.h"
+
+/*
+ * Coroutine support for record builds that wait for their queues instead
+ * of polling them.  Only available when the compiler implements C++20
+ * coroutines.
+ *
+ * A record build is a coroutine returning RecordTask.  It co_awaits
+ * nextPush() of its AwaitingFromQueue sources and then runs update() and
+ * serializeTo() on its tree as usual; the sources hand the values on to
+ * the FieldValues like FromQueue does.  A build that waits on a queue
+ * without new data suspends, and the next push into that queue hands it
+ * to a RecordExecutor, which resumes all builds that became ready in one
+ * batch on the thread that runs it.  Several pushes before the executor
+ * runs resume the build only once, with the latest value.  Destroying the
+ * task of a waiting build, scheduled or not, withdraws it from its source
+ * and executor.
+ */
+#ifdef __cpp_impl_coroutine
+
+#include <algorithm>
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include <mutex>
+#include <vector>
+
+class RecordExecutor
+{
+public:
+    // may be called from any thread
+    void schedule(std::coroutine_handle<> build)
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      ready.push_back(build);
+    }
+
+    size_t pending() const
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      return ready.size();
+    }
+
+    // Drops a build that is destroyed before it ran, also from a batch
+    // being resumed.
+    void cancel(std::coroutine_handle<> build)
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      ready.erase(std::remove(ready.begin(), ready.end(), build), ready.end());
+      std::replace(batch.begin(), batch.end(), build, std::coroutine_handle<>());
+    }
+
+    // Resumes the builds that were ready when called and returns their
+    // number; builds that become ready meanwhile wait for the next call.
+    size_t runReady()
+    {
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        batch.swap(ready);
+      }
+      size_t count = 0;
+      for(size_t i=0; ; ++i)
+      {
+        std::coroutine_handle<> build;
+        {
+          std::lock_guard<std::mutex> lock(mutex);
+          if(i == batch.size())
+          {
+            batch.clear();
+            return count;
+          }
+          build = batch[i];
+        }
+        if(build)
+        {
+          build.resume();
+          ++count;
+        }
+      }
+    }
+
+private:
+    mutable std::mutex mutex;
+    std::vector<std::coroutine_handle<> > ready;
+    std::vector<std::coroutine_handle<> > batch;
+};
+
+/*
+ * The coroutine type of a record build.  The build runs up to its first
+ * suspension when called and is destroyed with the task.  An exception
+ * leaving the build ends it and is kept in error().
+ */
+class RecordTask
+{
+public:
+    struct promise_type
+    {
+        RecordTask get_return_object()
+        {
+          return RecordTask(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+
+        std::suspend_never initial_suspend() { return std::suspend_never(); }
+        std::suspend_always final_suspend() noexcept { return std::suspend_always(); }
+        void return_void() {}
+        void unhandled_exception() { error = std::current_exception(); }
+
+        std::exception_ptr error;
+    };
+
+    RecordTask(RecordTask&& other)
+    :handle(other.handle)
+    {
+      other.handle = 0;
+    }
+
+    ~RecordTask()
+    {
+      if(handle)
+        handle.destroy();
+    }
+
+    bool done() const { return handle.done(); }
+    std::exception_ptr error() const { return handle.promise().error; }
+
+private:
+    explicit RecordTask(std::coroutine_handle<promise_type> task)
+    :handle(task)
+    {
+    }
+
+    RecordTask(RecordTask const&);
+    RecordTask& operator=(RecordTask const&);
+
+    std::coroutine_handle<promise_type> handle;
+};
+
+/*
+ * A FromQueue whose build can wait for the next push.  getNextValue()
+ * takes the value in the queue and marks every push so far as seen;
+ * nextPush() completes at once if there was a push since then and
+ * otherwise suspends the build until the next one.  The source registers
+ * itself as a listener of its queue for its lifetime.
+ */
+class AwaitingFromQueue : public DataQueueListener
+{
+public:
+    typedef DataQueue::value_type value_type;
+
+    AwaitingFromQueue(DataQueue* queue, RecordExecutor& executor)
+    :queue_(queue), executor_(executor), seen(0), waiter(0)
+    {
+      queue_->addListener(this);
+    }
+
+    ~AwaitingFromQueue()
+    {
+      queue_->removeListener(this);
+    }
+
+    value_type getNextValue()
+    {
+      seen = queue_->pushCount();
+      value_type val;
+      queue_->getAnyValue(val);
+      return val;
+    }
+
+    bool hasNewValue() const { return queue_->pushCount() != seen; }
+
+    class Awaiter
+    {
+    public:
+        explicit Awaiter(AwaitingFromQueue& source)
+        :source_(source)
+        {
+        }
+
+        // runs while the build waits only if its frame is destroyed
+        ~Awaiter()
+        {
+          if(!build_)
+            return;
+          std::lock_guard<std::mutex> lock(source_.mutex);
+          if(source_.waiter == build_)
+            source_.waiter = 0;
+          else
+            source_.executor_.cancel(build_);
+        }
+
+        bool await_ready() const { return source_.hasNewValue(); }
+
+        bool await_suspend(std::coroutine_handle<> build)
+        {
+          std::lock_guard<std::mutex> lock(source_.mutex);
+          // a push between await_ready() and here must not be missed
+          if(source_.hasNewValue())
+            return false;
+          source_.waiter = build;
+          build_ = build;
+          return true;
+        }
+
+        void await_resume() { build_ = 0; }
+
+    private:
+        AwaitingFromQueue& source_;
+        std::coroutine_handle<> build_;
+    };
+
+    Awaiter nextPush() { return Awaiter(*this); }
+
+    void pushed(DataQueue&)
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if(waiter)
+      {
+        executor_.schedule(waiter);
+        waiter = 0;
+      }
+    }
+
+private:
+    AwaitingFromQueue(AwaitingFromQueue const&);
+    AwaitingFromQueue& operator=(AwaitingFromQueue const&);
+
+    DataQueue* queue_;
+    RecordExecutor& executor_;
+    unsigned long seen;
+    std::mutex mutex;
+    std::coroutine_handle<> waiter;
+};
+
+#endif
+
+#endif
@@ -0,0 +1,391 @@
+// -*- c++ -*-
+#ifndef BLOCKCOMPRESS_H
+#define BLOCKCOMPRESS_H
+
+#include <cstddef>
+#include <cstring>
+#include <exception>
+#include <streambuf>
+#include <string>
+#include <vector>
+
+#if defined(__unix__)
+#include <unistd.h>
+#endif
+
+#include <boost/cstdint.hpp>
+
+#include "varint.h"
+
+/*
+ * Fast LZ77 compression in the LZ4 block format: a block is a sequence of
+ * a token byte (literal length in the high nibble, match length - 4 in
+ * the low one, 15 meaning more length bytes of 255 follow), the literals,
+ * a 2 byte little endian match offset and the remaining match length.
+ * The last sequence has literals only.  Matches are found greedily with
+ * one hash table probe per position and skip ahead faster the longer no
+ * match turns up, so incompressible data costs little.
+ *
+ * Blocks follow the LZ4 end of block rules (the last 5 bytes are
+ * literals, no match starts in the last 12), so they can be decoded by
+ * any LZ4 block decoder.
+ */
+class Lz4Block
+{
+public:
+    struct Malformed : public std::exception {};
+
+    static const size_t HashLog = 12;
+    static const size_t MaxOffset = 65535;
+
+    // the match finder's table of recent positions, reused between blocks
+    typedef std::vector<boost::uint32_t> HashTable;
+
+    static size_t compressBound(size_t size)
+    {
+      return size + size/255 + 16;
+    }
+
+    // compresses size bytes from source to at most compressBound(size)
+    // bytes at dest and returns their number
+    static size_t compress(const char* source, size_t size, char* dest, HashTable& table)
+    {
+      const size_t MinMatch = 4;
+      const size_t LastLiterals = 5;
+      const size_t MatchFindLimit = 12;
+
+      char* out = dest;
+      const char* anchor = source;
+      if(size > MatchFindLimit)
+      {
+        table.assign(size_t(1) << HashLog, 0);
+        const char* end = source + size;
+        const char* matchLimit = end - LastLiterals;
+        const char* findLimit = end - MatchFindLimit;
+        const char* ip = source + 1;
+        while(ip < findLimit)
+        {
+          boost::uint32_t sequence = read32(ip);
+          boost::uint32_t& slot = table[hash(sequence)];
+          const char* ref = source + slot;
+          slot = boost::uint32_t(ip - source);
+          if(size_t(ip - ref) > MaxOffset || read32(ref) != sequence)
+          {
+            ip += 1 + ((ip - anchor) >> 6);
+            continue;
+          }
+
+          while(ip > anchor && ref > source && ip[-1] == ref[-1])
+          {
+            --ip;
+            --ref;
+          }
+          size_t length = MinMatch;
+          while(ip + length < matchLimit && ip[length] == ref[length])
+            ++length;
+
+          out = writeSequence(out, anchor, size_t(ip - anchor), size_t(ip - ref), length - MinMatch);
+          ip += length;
+          anchor = ip;
+          if(ip < findLimit)
+            table[hash(read32(ip - 2))] = boost::uint32_t(ip - 2 - source);
+        }
+      }
+      size_t literals = size_t(source + size - anchor);
+      out = writeLength(out, literals, 0);
+      std::memcpy(out, anchor, literals);
+      return size_t(out + literals - dest);
+    }
+
+    // decompresses a block of size bytes to dest, which has room for
+    // capacity bytes, and returns the number of bytes produced
+    static size_t decompress(const char* source, size_t size, char* dest, size_t capacity)
+    {
+      const char* in = source;
+      const char* end = source + size;
+      char* out = dest;
+      char* outEnd = dest + capacity;
+      for(;;)
+      {
+        if(in == end)
+          throw Malformed();
+        unsigned token = (unsigned char)*in++;
+        size_t literals = readLength(in, end, token >> 4);
+        if(size_t(end - in) < literals || size_t(outEnd - out) < literals)
+          throw Malformed();
+        std::memcpy(out, in, literals);
+        in += literals;
+        out += literals;
+        if(in == end)
+          return size_t(out - dest);
+
+        if(end - in < 2)
+          throw Malformed();
+        size_t offset = (unsigned char)in[0] | size_t((unsigned char)in[1]) << 8;
+        in += 2;
+        size_t length = readLength(in, end, token & 15) + 4;
+        if(!offset || offset > size_t(out - dest) || size_t(outEnd - out) < length)
+          throw Malformed();
+        const char* ref = out - offset;
+        if(offset >= length)
+          std::memcpy(out, ref, length);
+        else
+          // byte by byte, the match overlaps the bytes it produces
+          for(size_t i=0; i<length; ++i)
+            out[i] = ref[i];
+        out += length;
+      }
+    }
+
+private:
+    static boost::uint32_t read32(const char* p)
+    {
+      boost::uint32_t value;
+      std::memcpy(&value, p, sizeof(value));
+      return value;
+    }
+
+    static size_t hash(boost::uint32_t sequence)
+    {
+      return (sequence * 2654435761u) >> (32 - HashLog);
+    }
+
+    // the token for a length, the extra bytes go after it
+    static char* writeLength(char* out, size_t length, unsigned matchNibble)
+    {
+      unsigned nibble = length < 15 ? unsigned(length) : 15;
+      *out++ = char(nibble << 4 | matchNibble);
+      return writeExtraLength(out, length);
+    }
+
+    static char* writeExtraLength(char* out, size_t length)
+    {
+      if(length >= 15)
+      {
+        for(length -= 15; length >= 255; length -= 255)
+          *out++ = char(255);
+        *out++ = char(length);
+      }
+      return out;
+    }
+
+    static char* writeSequence(char* out, const char* literals, size_t numLiterals,
+                               size_t offset, size_t matchLength)
+    {
+      unsigned matchNibble = matchLength < 15 ? unsigned(matchLength) : 15;
+      out = writeLength(out, numLiterals, matchNibble);
+      std::memcpy(out, literals, numLiterals);
+      out += numLiterals;
+      *out++ = char(offset);
+      *out++ = char(offset >> 8);
+      return writeExtraLength(out, matchLength);
+    }
+
+    static size_t readLength(const char*& in, const char* end, unsigned nibble)
+    {
+      size_t length = nibble;
+      if(nibble == 15)
+      {
+        unsigned char byte;
+        do
+        {
+          if(in == end)
+            throw Malformed();
+          byte = (unsigned char)*in++;
+          length += byte;
+        }
+        while(byte == 255);
+      }
+      return length;
+    }
+};
+
+/*
+ * Compresses everything written through it in blocks and passes the
+ * blocks on to another stream buffer.  Each block goes out as
+ *
+ *   varint raw size, varint stored size, the stored bytes
+ *
+ * where a block that does not get smaller is stored as it is, with both
+ * sizes equal.  A block is written when blockSize bytes have come
+ * together and on flush(), so a serializer flushes the stream after each
+ * batch of records; records may straddle blocks.
+ *
+ * The default block size keeps the block, its compressed copy and the
+ * hash table together within a quarter of the L2 cache, bounded by the
+ * 64 KiB reach of a match.
+ *
+ * Without a target, or when the target takes fewer bytes than given,
+ * writes fail like those to a full stream buffer and sync() returns -1.
+ */
+class CompressingStreamBuf : public std::streambuf
+{
+public:
+    explicit CompressingStreamBuf(std::streambuf* target = 0, size_t blockSize = defaultBlockSize())
+    :target_(target), block(blockSize), compressed(Lz4Block::compressBound(blockSize)),
+     rawBytes(0), storedBytes(0)
+    {
+      setp(&block[0], &block[0] + block.size());
+    }
+
+    ~CompressingStreamBuf()
+    {
+      writeBlock();
+    }
+
+    void setTarget(std::streambuf* target) { target_ = target; }
+    size_t blockSize() const { return block.size(); }
+
+    // totals over the blocks written, for the compression ratio
+    unsigned long long rawSize() const { return rawBytes; }
+    unsigned long long storedSize() const { return storedBytes; }
+
+    static size_t defaultBlockSize()
+    {
+      long l2 = 0;
+#if defined(_SC_LEVEL2_CACHE_SIZE)
+      l2 = sysconf(_SC_LEVEL2_CACHE_SIZE);
+#endif
+      if(l2 <= 0)
+        l2 = 256*1024;
+      // block, output and table
+      size_t size = (size_t(l2)/4 - (sizeof(boost::uint32_t) << Lz4Block::HashLog)) / 2;
+      size_t blockSize = 4096;
+      while(blockSize*2 <= size && blockSize*2 <= Lz4Block::MaxOffset + 1)
+        blockSize *= 2;
+      return blockSize;
+    }
+
+protected:
+    int_type overflow(int_type c)
+    {
+      if(!writeBlock())
+        return traits_type::eof();
+      if(!traits_type::eq_int_type(c, traits_type::eof()))
+      {
+        *pptr() = traits_type::to_char_type(c);
+        pbump(1);
+      }
+      return traits_type::not_eof(c);
+    }
+
+    int sync()
+    {
+      if(!writeBlock())
+        return -1;
+      return target_ ? target_->pubsync() : 0;
+    }
+
+private:
+    CompressingStreamBuf(CompressingStreamBuf const&);
+    CompressingStreamBuf& operator=(CompressingStreamBuf const&);
+
+    // false if the block could not be passed on whole
+    bool writeBlock()
+    {
+      size_t size = size_t(pptr() - pbase());
+      if(!size)
+        return true;
+      if(!target_)
+        return false;
+      size_t storedSize = Lz4Block::compress(pbase(), size, &compressed[0], table);
+      const char* stored = &compressed[0];
+      if(storedSize >= size)
+      {
+        storedSize = size;
+        stored = pbase();
+      }
+      char header[2*Varint::MaxBytes];
+      char* end = Varint::encode(storedSize, Varint::encode(size, header));
+      if(target_->sputn(header, end - header) != end - header ||
+         target_->sputn(stored, storedSize) != std::streamsize(storedSize))
+        return false;
+      rawBytes += size;
+      storedBytes += size_t(end - header) + storedSize;
+      setp(&block[0], &block[0] + block.size());
+      return true;
+    }
+
+    std::streambuf* target_;
+    std::vector<char> block;
+    std::vector<char> compressed;
+    Lz4Block::HashTable table;
+    unsigned long long rawBytes;
+    unsigned long long storedBytes;
+};
+
+/*
+ * The reading side of CompressingStreamBuf: turns the blocks back into
+ * the record bytes for the decoders.  Blocks claiming more raw bytes than
+ * the block size of the writer, which the reader is given, are malformed.
+ */
+class BlockDecompressor
+{
+public:
+    typedef Lz4Block::Malformed Malformed;
+
+    explicit BlockDecompressor(size_t maxBlockSize = CompressingStreamBuf::defaultBlockSize())
+    :maxBlock(maxBlockSize)
+    {
+    }
+
+    size_t maxBlockSize() const { return maxBlock; }
+
+    // Appends the bytes of the block at data to output and returns the
+    // size of the block, or 0 while the block is not complete yet.
+    size_t decodeBlock(const char* data, size_t size, std::string& output) const
+    {
+      const char* pos = data;
+      const char* end = data + size;
+      size_t rawSize, storedSize;
+      try
+      {
+        rawSize = Varint::decode(pos, end);
+        storedSize = Varint::decode(pos, end);
+      }
+      catch(Varint::Truncated const&)
+      {
+        return 0;
+      }
+      if(rawSize > maxBlock || storedSize > rawSize)
+        throw Malformed();
+      if(storedSize > size_t(end - pos))
+        return 0;
+
+      size_t base = output.size();
+      if(storedSize == rawSize)
+        output.append(pos, storedSize);
+      else
+      {
+        output.resize(base + rawSize);
+        size_t produced = 0;
+        try
+        {
+          produced = Lz4Block::decompress(pos, storedSize, &output[base], rawSize);
+        }
+        catch(Malformed const&)
+        {
+        }
+        if(produced != rawSize)
+        {
+          output.resize(base);
+          throw Malformed();
+        }
+      }
+      return size_t(pos + storedSize - data);
+    }
+
+    // appends the bytes of all complete blocks and returns their size
+    size_t decode(const char* data, size_t size, std::string& output) const
+    {
+      size_t used = 0;
+      while(size_t block = decodeBlock(data + used, size - used, output))
+        used += block;
+      return used;
+    }
+
+private:
+    size_t maxBlock;
+};
+
+#endif
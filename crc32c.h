@@ -0,0 +1,148 @@
+// -*- c++ -*-
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <cstddef>
+#include <cstring>
+#include <streambuf>
+
+#include <boost/cstdint.hpp>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <nmmintrin.h>
+#define CRC32C_HARDWARE 1
+#endif
+
+/*
+ * CRC-32C (Castagnoli), as used by iSCSI, ext4 and most storage formats.
+ * The SSE4.2 crc32 instruction is used when the CPU has it, checked once
+ * at run time, so the build needs no -msse4.2; elsewhere a table does
+ * one byte at a time.
+ *
+ * update() continues a running checksum: start from 0 and feed the bytes
+ * in any number of pieces.
+ */
+class Crc32c
+{
+public:
+    static boost::uint32_t update(boost::uint32_t crc, const char* data, size_t size)
+    {
+#ifdef CRC32C_HARDWARE
+      if(hardware())
+        return updateHardware(crc, data, size);
+#endif
+      return updateSoftware(crc, data, size);
+    }
+
+    static boost::uint32_t compute(const char* data, size_t size)
+    {
+      return update(0, data, size);
+    }
+
+    static bool hardware()
+    {
+#ifdef CRC32C_HARDWARE
+      static const bool available = __builtin_cpu_supports("sse4.2");
+      return available;
+#else
+      return false;
+#endif
+    }
+
+    static boost::uint32_t updateSoftware(boost::uint32_t crc, const char* data, size_t size)
+    {
+      const boost::uint32_t* table = Table::get();
+      crc = ~crc;
+      for(size_t i=0; i<size; ++i)
+        crc = table[(crc ^ (unsigned char)data[i]) & 0xff] ^ (crc >> 8);
+      return ~crc;
+    }
+
+#ifdef CRC32C_HARDWARE
+    __attribute__((target("sse4.2")))
+    static boost::uint32_t updateHardware(boost::uint32_t crc, const char* data, size_t size)
+    {
+      crc = ~crc;
+#ifdef __x86_64__
+      boost::uint64_t wide = crc;
+      for(; size >= 8; size -= 8, data += 8)
+      {
+        boost::uint64_t word;
+        std::memcpy(&word, data, sizeof(word));
+        wide = _mm_crc32_u64(wide, word);
+      }
+      crc = boost::uint32_t(wide);
+#endif
+      for(; size; --size)
+        crc = _mm_crc32_u8(crc, (unsigned char)*data++);
+      return ~crc;
+    }
+#endif
+
+private:
+    class Table
+    {
+    public:
+        static const boost::uint32_t* get()
+        {
+          static const Table table;
+          return table.entries;
+        }
+
+    private:
+        Table()
+        {
+          // the reflected Castagnoli polynomial
+          for(boost::uint32_t i=0; i<256; ++i)
+          {
+            boost::uint32_t crc = i;
+            for(int bit=0; bit<8; ++bit)
+              crc = (crc >> 1) ^ (0x82f63b78u & (0u - (crc & 1)));
+            entries[i] = crc;
+          }
+        }
+
+        boost::uint32_t entries[256];
+    };
+};
+
+/*
+ * Passes everything written on to another stream buffer and keeps the
+ * CRC-32C of it, so records are checksummed as they are produced
+ * instead of in a second pass over the output.
+ */
+class Crc32cStreamBuf : public std::streambuf
+{
+public:
+    explicit Crc32cStreamBuf(std::streambuf* target = 0)
+    :target_(target), crc(0)
+    {
+    }
+
+    void setTarget(std::streambuf* target) { target_ = target; }
+
+    boost::uint32_t checksum() const { return crc; }
+    void reset() { crc = 0; }
+
+protected:
+    int_type overflow(int_type c)
+    {
+      if(traits_type::eq_int_type(c, traits_type::eof()))
+        return traits_type::not_eof(c);
+      char byte = traits_type::to_char_type(c);
+      crc = Crc32c::update(crc, &byte, 1);
+      return target_->sputc(byte);
+    }
+
+    std::streamsize xsputn(const char* s, std::streamsize n)
+    {
+      crc = Crc32c::update(crc, s, size_t(n));
+      return target_->sputn(s, n);
+    }
+
+private:
+    std::streambuf* target_;
+    boost::uint32_t crc;
+};
+
+#endif
@@ -2,42 +2,110 @@
 #ifndef DATAQUEUE_H
 #define DATAQUEUE_H
 
+#include <algorithm>
+#include <atomic>
 #include <utility>
 #include <vector>
 #include <boost/variant.hpp>
 #include <boost/mpl/vector.hpp>
+#include <boost/container/small_vector.hpp>
+
+#include "latency.h"
+#include "stringtable.h"
 
 namespace mpl = boost::mpl;
 
 /*
- * <long, double, string> are the BaseTypes
+ * <long, double, string, InternedString> are the BaseTypes
  * a pair of int and a variant over BaseTypes is BaseItemID
- * a vector of BaseItemID is BaseItemIDList
+ * a vector of BaseItemID is BaseItemIDList, the first
+ *   BaseItemIDListInline entries are stored inside the QueueItem, which
+ *   every scalar value pays for as well (224 bytes against 56 with a
+ *   std::vector on LP64; see DISABLED_ScalarQueueThroughput)
  * a variant over BaseTypes+BaseItemID+BaseItemIDList is QueueItem
  */
-typedef boost::mpl::vector<long, double, std::string> BaseTypes;
+typedef boost::mpl::vector<long, double, std::string, InternedString> BaseTypes;
 typedef boost::make_variant_over<BaseTypes>::type BaseItem;
 typedef std::pair<int, BaseItem> BaseItemID;
-typedef std::vector<BaseItemID> BaseItemIDList;
+const std::size_t BaseItemIDListInline = 4;
+typedef boost::container::small_vector<BaseItemID, BaseItemIDListInline> BaseItemIDList;
 typedef boost::make_variant_over<
   mpl::push_back<
     mpl::push_back<BaseTypes, BaseItemID>::type, 
     BaseItemIDList>::type>::type QueueItem;
 
+class DataQueue;
+
+/*
+ * Told about every push into a DataQueue it is registered with, on the
+ * pushing thread and after the new value is in place.
+ */
+class DataQueueListener
+{
+public:
+    virtual ~DataQueueListener() {}
+    virtual void pushed(DataQueue& queue) = 0;
+};
+
+/*
+ * Only the push count is safe to read while another thread pushes.  The
+ * value, and the string table and timestamp that go with it, are not:
+ * listeners tell another thread that there is a new value, but that
+ * thread reads it (getAnyValue(), a tree's update()) only under a lock
+ * the pushing thread holds around push() as well.  Listeners are added
+ * and removed while no push runs.
+ */
 class DataQueue
 {
 public:
     typedef QueueItem value_type;
 
     DataQueue()
-    :value()
+    :value(), strings(0), pushes(0),
+     timestamping(false), stamp(0)
     {
     }
     
     DataQueue(value_type initialValue)
-    :value(initialValue)
+    :value(initialValue), strings(0), pushes(0),
+     timestamping(false), stamp(0)
+    {
+    }
+
+    // strings pushed from now on are stored as InternedStrings of the table
+    void setStringTable(StringTable* table)
     {
+      strings = table;
     }
+
+    // listeners are told in the order they were added
+    void addListener(DataQueueListener* listener)
+    {
+      listeners.push_back(listener);
+    }
+
+    // removes one registration of the listener, if there is one
+    void removeListener(DataQueueListener* listener)
+    {
+      std::vector<DataQueueListener*>::iterator it =
+        std::find(listeners.begin(), listeners.end(), listener);
+      if(it != listeners.end())
+        listeners.erase(it);
+    }
+
+    size_t listenerCount() const { return listeners.size(); }
+
+    // stamps every push with LatencyClock::now() from now on
+    void setTimestamping(bool enable)
+    {
+      timestamping = enable;
+    }
+
+    // when the value in the queue was pushed, 0 unless timestamping
+    LatencyClock::Ticks pushTimestamp() const { return stamp; }
+
+    // the number of push() calls so far
+    unsigned long pushCount() const { return pushes; }
     
     bool getAnyValue(value_type& val)
     {
@@ -47,10 +115,24 @@ public:
 
     void push(value_type const& val)
     {
-      value = val;
+      if(timestamping)
+        stamp = LatencyClock::now();
+      const std::string* text = strings ? boost::get<std::string>(&val) : 0;
+      if(text)
+        value = strings->intern(*text);
+      else
+        value = val;
+      ++pushes;
+      for(size_t i=0; i<listeners.size(); ++i)
+        listeners[i]->pushed(*this);
     }
 
 private:
     value_type value;
+    StringTable* strings;
+    std::atomic<unsigned long> pushes;
+    std::vector<DataQueueListener*> listeners;
+    bool timestamping;
+    LatencyClock::Ticks stamp;
 };
 #endif
@@ -0,0 +1,216 @@
+// -*- c++ -*-
+#ifndef DELTACODEC_H
+#define DELTACODEC_H
+
+#include <algorithm>
+#include <cstddef>
+#include <exception>
+#include <limits>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include <boost/dynamic_bitset.hpp>
+
+/*
+ * Packs bit fields LSB-first into bytes: the first bit written becomes
+ * bit 0 of the first byte.  Bits beyond the width of unsigned long are
+ * written as zeros.
+ */
+class BitWriter
+{
+public:
+    explicit BitWriter(std::string& output)
+    :out(output), acc(0), used(0)
+    {
+    }
+
+    void write(unsigned long value, size_t numBits)
+    {
+      while(numBits)
+      {
+        size_t take = std::min(numBits, size_t(8 - used));
+        acc |= (value & ((1u << take) - 1)) << used;
+        used += take;
+        numBits -= take;
+        value = value >> take;
+        if(used == 8)
+        {
+          out.push_back(char(acc));
+          acc = 0;
+          used = 0;
+        }
+      }
+    }
+
+    // pads the last byte with zero bits
+    void flush()
+    {
+      if(used)
+      {
+        out.push_back(char(acc));
+        acc = 0;
+        used = 0;
+      }
+    }
+
+private:
+    std::string& out;
+    unsigned int acc;
+    size_t used;
+};
+
+class BitReader
+{
+public:
+    struct Truncated : public std::exception {};
+
+    BitReader(const char* data, size_t size)
+    :pos(reinterpret_cast<const unsigned char*>(data)),
+     end(pos + size), used(0)
+    {
+    }
+
+    unsigned long read(size_t numBits)
+    {
+      unsigned long value = 0;
+      size_t shift = 0;
+      while(numBits)
+      {
+        if(pos == end)
+          throw Truncated();
+        size_t take = std::min(numBits, size_t(8 - used));
+        unsigned long chunk = (*pos >> used) & ((1u << take) - 1);
+        if(shift < size_t(std::numeric_limits<unsigned long>::digits))
+          value |= chunk << shift;
+        shift += take;
+        used += take;
+        numBits -= take;
+        if(used == 8)
+        {
+          ++pos;
+          used = 0;
+        }
+      }
+      return value;
+    }
+
+    // skips the rest of a partially read byte
+    void align()
+    {
+      if(used)
+      {
+        ++pos;
+        used = 0;
+      }
+    }
+
+    const char* position() const { return reinterpret_cast<const char*>(pos); }
+
+private:
+    const unsigned char* pos;
+    const unsigned char* end;
+    size_t used;
+};
+
+/*
+ * Delta records carry only the fields that changed since the previous
+ * record: a presence bitmap with one bit per field, padded to whole bytes,
+ * followed by the values of the changed fields in field order, each packed
+ * at the width of its field and the whole padded to whole bytes.
+ *
+ * The encoder remembers the change version each field had when it was last
+ * sent, so several update() calls between two records are fine.
+ */
+class DeltaEncoder
+{
+public:
+    void addField(size_t numBits)
+    {
+      bits.push_back(numBits);
+      sentVersions.push_back(0);
+      values.push_back(0);
+      changed.resize(bits.size());
+    }
+
+    std::vector<size_t> const& fieldBits() const { return bits; }
+    boost::dynamic_bitset<> const& changedFields() const { return changed; }
+
+    bool hasChanged(size_t field, unsigned long version) const
+    {
+      return version != sentVersions[field];
+    }
+
+    void setChanged(size_t field, unsigned long version, unsigned long value)
+    {
+      changed[field] = true;
+      sentVersions[field] = version;
+      values[field] = value;
+    }
+
+    void beginRecord() { changed.reset(); }
+
+    void writeTo(std::ostream& output)
+    {
+      buffer.clear();
+      BitWriter writer(buffer);
+      for(size_t f=0; f<bits.size(); ++f)
+        writer.write(changed[f], 1);
+      writer.flush();
+      for(size_t f=0; f<bits.size(); ++f)
+      {
+        if(changed[f])
+          writer.write(values[f], bits[f]);
+      }
+      writer.flush();
+      output.write(buffer.data(), buffer.size());
+    }
+
+private:
+    std::vector<size_t> bits;
+    std::vector<unsigned long> sentVersions;
+    std::vector<unsigned long> values;
+    boost::dynamic_bitset<> changed;
+    std::string buffer;
+};
+
+/*
+ * Rebuilds the field values from a stream of delta records.  Fields
+ * narrower than a long are zero-extended.
+ */
+class DeltaDecoder
+{
+public:
+    typedef BitReader::Truncated Truncated;
+
+    explicit DeltaDecoder(std::vector<size_t> const& fieldBits)
+    :bits(fieldBits), fieldValues(fieldBits.size(), 0), changed(fieldBits.size())
+    {
+    }
+
+    // applies one record and returns the number of bytes it took
+    size_t decode(const char* data, size_t size)
+    {
+      BitReader reader(data, size);
+      for(size_t f=0; f<bits.size(); ++f)
+        changed[f] = reader.read(1);
+      reader.align();
+      for(size_t f=0; f<bits.size(); ++f)
+      {
+        if(changed[f])
+          fieldValues[f] = long(reader.read(bits[f]));
+      }
+      reader.align();
+      return reader.position() - data;
+    }
+
+    std::vector<long> const& values() const { return fieldValues; }
+    boost::dynamic_bitset<> const& changedFields() const { return changed; }
+
+private:
+    std::vector<size_t> bits;
+    std::vector<long> fieldValues;
+    boost::dynamic_bitset<> changed;
+};
+
+#endif
@@ -1,20 +1,110 @@
 #ifndef FIELDVALUE_H
 #define FIELDVALUE_H
 
+#include <algorithm>
 #include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include <ostream>
 #include <fstream>
+#include <sstream>
 #include <vector>
 #include <numeric>
+#include <limits>
+#include <chrono>
+#include <string>
+#include <unordered_map>
 
 #include <boost/shared_ptr.hpp>
+#include <boost/weak_ptr.hpp>
 #include <boost/foreach.hpp>
 #include <boost/dynamic_bitset.hpp>
 
 #include <gtest/gtest.h>
 
 #include "dataqueue.h"
+#include "awaitqueue.h"
+#include "queuenotifier.h"
+#include "alloctrack.h"
+#include "blockcompress.h"
+#include "crc32c.h"
+#include "streambufs.h"
+#include "deltacodec.h"
+#include "forcodec.h"
+#include "gatheroutput.h"
+#include "nodearena.h"
+#include "schema.h"
+#include "schemaimage.h"
+#include "serializerpool.h"
+#include "taskpool.h"
+#include "treepublisher.h"
+#include "textencoder.h"
+#include "tlvcodec.h"
+#include "varint.h"
+
+/*
+ * EagerUpdate pulls a new value from the data source on every update(),
+ * LazyUpdate only marks the value stale there and pulls it on the first
+ * getValue()/serialize after that.
+ */
+enum UpdateMode
+{
+    EagerUpdate,
+    LazyUpdate
+};
+
+/*
+ * How a field writes its value.  TextEncoding is the "(index,value)" text
+ * form.  The binary encodings store the packed integer of the value (see
+ * packedValue) and write the same bytes for every repetition:
+ * VarintEncoding as unsigned LEB128, ZigZagEncoding as LEB128 of its
+ * zigzag form, FixedEncoding as 8 bytes little endian.
+ */
+enum FieldEncoding
+{
+    TextEncoding,
+    VarintEncoding,
+    ZigZagEncoding,
+    FixedEncoding
+};
+
+inline char* encodeNumber(FieldEncoding encoding, unsigned long value, char* out)
+{
+    switch(encoding)
+    {
+    case ZigZagEncoding:
+      return Varint::encode(ZigZag::encode(long(value)), out);
+    case FixedEncoding:
+      for(int i=0; i<8; ++i)
+        *out++ = char(value >> (8*i));
+      return out;
+    default:
+      return Varint::encode(value, out);
+    }
+}
+
+inline size_t encodedNumberSize(FieldEncoding encoding, unsigned long value)
+{
+    switch(encoding)
+    {
+    case ZigZagEncoding:
+      return Varint::size(ZigZag::encode(long(value)));
+    case FixedEncoding:
+      return 8;
+    default:
+      return Varint::size(value);
+    }
+}
+
+// a hint to start loading a cache line the loop will reach later
+inline void prefetchAddress(const void* address)
+{
+#if defined(__GNUC__)
+    __builtin_prefetch(address);
+#else
+    (void)address;
+#endif
+}
 
 template<typename ValueType>
 class FieldValueBase
@@ -28,38 +118,450 @@ public:
     virtual value_type getValue() const { return value_type(); }
     virtual void serializeTo(std::ostream& output) = 0;
     virtual void serializeNthValueTo(size_t index, std::ostream& output) = 0;
+
+    // Adds the bytes serializeTo() would write to a gather list, as
+    // references where the node keeps them encoded already.
+    virtual void serializeSegmentsTo(GatherOutput& output) { serializeTo(output.stream()); }
+
+    // The number of bytes serializeTo()/serializeNthValueTo() would write
+    // now: exact for binary encodings and text of integers and strings,
+    // an upper bound where a double is written as text.
+    virtual size_t serializedSize() = 0;
+    virtual size_t serializedNthSize(size_t index) = 0;
+
+    // True if, once changeVersion() was called, serializeNthValueTo() and
+    // serializedNthSize() may run for different indices on several
+    // threads at once.
+    virtual bool reentrantNthValues() const { return false; }
+
+    // applies to this node and the subtree below it as built so far
+    virtual void setUpdateMode(UpdateMode) {}
+    virtual void setEncoding(FieldEncoding) {}
+
+    // How many fields ahead the loops over the fields of a node prefetch,
+    // 0 for not at all; applies like setUpdateMode().  A loop at field f
+    // prefetches the node of field f + 2*distance and the data of field
+    // f + distance, at the address the parent took from dataAddress()
+    // when the field was added, so the loop never touches a node early.
+    virtual void setPrefetchDistance(size_t) {}
+
+    // What update() of this node reads beyond the node, 0 for nothing.
+    // Must stay where it is for the life of the node.
+    virtual const void* dataAddress() const { return 0; }
+
+    // Grows whenever the value of this node or of any node below it
+    // changes, so equal versions mean equal serialized bytes.  Lazy nodes
+    // pull their pending value first.
+    virtual unsigned long changeVersion() = 0;
+
+    // changeVersion() without pulling: 0 while a lazy node at or below
+    // this one has a pull pending, which callers take as changed.
+    virtual unsigned long knownVersion() { return changeVersion(); }
+
+    // Schema optimisation pass, to be run once the tree is built: fields
+    // fed by constant sources are evaluated and encoded once and are only
+    // re-encoded after their constant was set again.
+    virtual void foldConstants() {}
+
+    // For folded constant fields, a counter that moves whenever the constant
+    // is set again; 0 for everything else.
+    virtual const unsigned long* constantGeneration() const { return 0; }
+
+    // Records the time from push to now of the pushes pulled since the
+    // last call, also those that repeated the value and left the bytes as
+    // they were, for sources that stamp their pushes; see
+    // DataQueue::setTimestamping().
+    virtual void recordLatencies(LatencyHistogram&, LatencyClock::Ticks) {}
     
 protected:
   FieldValueBase() {}
 };
 
+/*
+ * The integer the bit-packed encodings store for a value: longs as they
+ * are, interned strings as their id.  Anything else throws boost::bad_get.
+ */
+template<typename Variant>
+bool isPackable(Variant const& value)
+{
+    return boost::get<long>(&value) || boost::get<InternedString>(&value);
+}
+
+template<typename Variant>
+unsigned long packedValue(Variant const& value)
+{
+    if(const InternedString* interned = boost::get<InternedString>(&value))
+      return interned->id;
+    return boost::get<long>(value);
+}
+
+/*
+ * Text form of a value: numbers through the TextEncoder, strings as they
+ * are, a BaseItemID as "id:value" and a list as "[id:value;id:value]".
+ */
+inline void writeValueText(std::ostream& output, BaseItem const& value)
+{
+    if(const std::string* text = stringValue(value))
+    {
+      output.write(text->data(), text->size());
+      return;
+    }
+    char buf[TextEncoder::MaxChars];
+    output.write(buf, boost::apply_visitor(TextEncoder::Visitor(buf), value) - buf);
+}
+
+inline void writeValueText(std::ostream& output, BaseItemID const& item)
+{
+    char buf[TextEncoder::MaxChars + 1];
+    char* pos = TextEncoder::formatLong(item.first, buf);
+    *pos++ = ':';
+    output.write(buf, pos - buf);
+    writeValueText(output, item.second);
+}
+
+inline void writeValueText(std::ostream& output, QueueItem const& value)
+{
+    if(const BaseItemID* item = boost::get<BaseItemID>(&value))
+    {
+      writeValueText(output, *item);
+    }
+    else if(const BaseItemIDList* list = boost::get<BaseItemIDList>(&value))
+    {
+      output.put('[');
+      for(BaseItemIDList::const_iterator it = list->begin(); it != list->end(); ++it)
+      {
+        if(it != list->begin())
+          output.put(';');
+        writeValueText(output, *it);
+      }
+      output.put(']');
+    }
+    else if(const std::string* text = stringValue(value))
+    {
+      output.write(text->data(), text->size());
+    }
+    else
+    {
+      char buf[TextEncoder::MaxChars];
+      output.write(buf, boost::apply_visitor(TextEncoder::Visitor(buf), value) - buf);
+    }
+}
+
+/*
+ * The number of characters writeValueText() writes for a value, with
+ * doubles counted as TextEncoder::MaxChars.
+ */
+template<typename Variant>
+size_t baseValueTextSize(Variant const& value)
+{
+    if(const std::string* text = stringValue(value))
+      return text->size();
+    if(const long* number = boost::get<long>(&value))
+      return TextEncoder::longSize(*number);
+    return TextEncoder::MaxChars;
+}
+
+inline size_t valueTextSize(BaseItemID const& item)
+{
+    return TextEncoder::longSize(item.first) + 1 + baseValueTextSize(item.second);
+}
+
+inline size_t valueTextSize(QueueItem const& value)
+{
+    if(const BaseItemID* item = boost::get<BaseItemID>(&value))
+      return valueTextSize(*item);
+    if(const BaseItemIDList* list = boost::get<BaseItemIDList>(&value))
+    {
+      size_t size = list->empty() ? 2 : 1 + list->size();
+      for(BaseItemIDList::const_iterator it = list->begin(); it != list->end(); ++it)
+        size += valueTextSize(*it);
+      return size;
+    }
+    return baseValueTextSize(value);
+}
+
+/*
+ * Sources whose value only changes through an explicit setter specialize
+ * this to expose a counter that is bumped by that setter.
+ */
+template<typename DataSource>
+struct ConstantSourceTraits
+{
+    static const unsigned long* generation(DataSource&) { return 0; }
+};
+
+/*
+ * Sources that know when their values were pushed specialize this to
+ * return the LatencyClock stamp of the value they returned last.
+ */
+template<typename DataSource>
+struct TimestampSourceTraits
+{
+    static LatencyClock::Ticks timestamp(DataSource&) { return 0; }
+};
+
 template<typename DataSource>
 class FieldValue : public FieldValueBase<typename DataSource::value_type>
 {
 public:
     typedef typename DataSource::value_type value_type;
     
-    void update() {  dataValue = dataSource.getNextValue(); }
-    value_type getValue() const { return dataValue; }
+    void update()
+    {
+      if(folded)
+        return;
+      if(updateMode == LazyUpdate)
+        stale = true;
+      else
+        pull();
+    }
+
+    value_type getValue() const { refresh(); return dataValue; }
 
     explicit FieldValue(DataSource& source)
-    :dataSource(source)
+    :dataSource(source), version(0), updateMode(EagerUpdate), encoding(TextEncoding),
+     stale(false), folded(false), foldedGeneration(0), pushStamp(0), recordedStamp(0)
+    {
+    }
+
+    void setUpdateMode(UpdateMode mode) { updateMode = mode; }
+
+    const void* dataAddress() const { return &dataSource; }
+
+    // the bytes change, so this counts as a change of the value
+    void setEncoding(FieldEncoding newEncoding)
+    {
+      if(encoding == newEncoding)
+        return;
+      encoding = newEncoding;
+      ++version;
+      if(folded)
+        fold();
+    }
+
+    unsigned long changeVersion() { refresh(); return version; }
+
+    unsigned long knownVersion()
+    {
+      if(stale)
+        return 0;
+      refresh();
+      return version;
+    }
+
+    void foldConstants()
+    {
+      if(ConstantSourceTraits<DataSource>::generation(dataSource))
+      {
+        folded = true;
+        fold();
+      }
+    }
+
+    const unsigned long* constantGeneration() const
+    {
+      return folded ? ConstantSourceTraits<DataSource>::generation(dataSource) : 0;
+    }
+
+    // every push pulled is recorded once, whether it changed the value or not
+    void recordLatencies(LatencyHistogram& histogram, LatencyClock::Ticks now)
     {
+      if(pushStamp != recordedStamp)
+      {
+        histogram.record(now - pushStamp);
+        recordedStamp = pushStamp;
+      }
     }
     
     void serializeTo(std::ostream& output)
     {
-      output << boost::get<long>(dataValue);
+      refresh();
+      if(folded && !encoded.empty())
+        output.write(encoded.data(), encoded.size());
+      else if(encoding != TextEncoding)
+      {
+        char buf[Varint::MaxBytes];
+        output.write(buf, encodeNumber(encoding, packedValue(dataValue), buf) - buf);
+      }
+      else
+        writeValueText(output, dataValue);
+    }
+
+    // folded constants are referenced where they are kept encoded
+    void serializeSegmentsTo(GatherOutput& output)
+    {
+      refresh();
+      if(folded && !encoded.empty())
+        output.addReference(encoded.data(), encoded.size());
+      else
+        serializeTo(output.stream());
+    }
+    
+    size_t serializedSize()
+    {
+      refresh();
+      if(folded && !encoded.empty())
+        return encoded.size();
+      if(encoding != TextEncoding)
+        return encodedNumberSize(encoding, packedValue(dataValue));
+      return valueTextSize(dataValue);
+    }
+
+    // "(index," and ")" around the value in text
+    size_t serializedNthSize(size_t index)
+    {
+      if(encoding != TextEncoding)
+        return serializedSize();
+      return TextEncoder::unsignedSize(index) + 3 + serializedSize();
     }
+
+    // the value is pulled by changeVersion(), formatting only reads it
+    bool reentrantNthValues() const { return true; }
     
     void serializeNthValueTo(size_t index, std::ostream& output)
     {
-        output << '(' << index << ',' << boost::get<long>(dataValue) << ')';
+        if(encoding != TextEncoding)
+        {
+          serializeTo(output);
+          return;
+        }
+        refresh();
+        char buf[2*TextEncoder::MaxChars + 2];
+        char* pos = buf;
+        *pos++ = '(';
+        pos = TextEncoder::formatUnsigned(index, pos);
+        *pos++ = ',';
+        if(folded && !encoded.empty() && encoded.size() <= TextEncoder::MaxChars)
+        {
+          std::memcpy(pos, encoded.data(), encoded.size());
+          pos += encoded.size();
+        }
+        else if(TextEncoder::canFormat(dataValue))
+          pos = boost::apply_visitor(TextEncoder::Visitor(pos), dataValue);
+        else
+        {
+          output.write(buf, pos - buf);
+          if(folded && !encoded.empty())
+            output.write(encoded.data(), encoded.size());
+          else
+            writeValueText(output, dataValue);
+          pos = buf;
+        }
+        *pos++ = ')';
+        output.write(buf, pos - buf);
     }
+
+protected:
+    // the value after any pending lazy or constant refresh, without a copy
+    value_type const& currentValue() const { refresh(); return dataValue; }
     
 private:
-    value_type  dataValue;
+    void fold() const
+    {
+      pull();
+      stale = false;
+      foldedGeneration = *ConstantSourceTraits<DataSource>::generation(dataSource);
+      encoded.clear();
+      char buf[TextEncoder::MaxChars];
+      if(encoding != TextEncoding)
+      {
+        if(isPackable(dataValue))
+          encoded.assign(buf, encodeNumber(encoding, packedValue(dataValue), buf));
+      }
+      else if(TextEncoder::canFormat(dataValue))
+        encoded.assign(buf, boost::apply_visitor(TextEncoder::Visitor(buf), dataValue));
+      else if(const std::string* text = stringValue(dataValue))
+        encoded = *text;
+    }
+
+    void pull() const
+    {
+      value_type next = dataSource.getNextValue();
+      if(version == 0 || !(next == dataValue))
+      {
+        dataValue = next;
+        ++version;
+      }
+      pushStamp = TimestampSourceTraits<DataSource>::timestamp(dataSource);
+    }
+
+    void refresh() const
+    {
+      if(folded)
+      {
+        if(*ConstantSourceTraits<DataSource>::generation(dataSource) != foldedGeneration)
+          fold();
+      }
+      else if(stale)
+      {
+        pull();
+        stale = false;
+      }
+    }
+
+    // what update() and serialization look at on every round comes first,
+    // so that with the vtable pointer it shares a cache line with the
+    // start of the value, which is where a long or double is kept
     DataSource&  dataSource;
+    mutable unsigned long  version;
+    UpdateMode  updateMode;
+    FieldEncoding  encoding;
+    mutable bool  stale;
+    bool  folded;
+    mutable unsigned long  foldedGeneration;
+    mutable value_type  dataValue;
+    mutable LatencyClock::Ticks  pushStamp;
+    LatencyClock::Ticks  recordedStamp;
+    mutable std::string  encoded;
+};
+
+/*
+ * A field serialized in the binary TLV form of TlvEncoder, which covers
+ * BaseItemID and BaseItemIDList values as well as the base types.  Lists
+ * are encoded as one value in a single pass.  Every repetition carries
+ * the same bytes; the index is implied by the position in the record.
+ */
+template<typename DataSource>
+class TlvFieldValue : public FieldValue<DataSource>
+{
+public:
+    explicit TlvFieldValue(DataSource& source)
+    :FieldValue<DataSource>(source)
+    {
+    }
+
+    void serializeTo(std::ostream& output)
+    {
+      buffer.clear();
+      TlvEncoder::encode(this->currentValue(), buffer);
+      output.write(buffer.data(), buffer.size());
+    }
+
+    void serializeNthValueTo(size_t, std::ostream& output)
+    {
+      serializeTo(output);
+    }
+
+    void serializeSegmentsTo(GatherOutput& output)
+    {
+      serializeTo(output.stream());
+    }
+
+    size_t serializedSize()
+    {
+      return TlvEncoder::encodedSize(this->currentValue());
+    }
+
+    size_t serializedNthSize(size_t)
+    {
+      return serializedSize();
+    }
+
+    // encodes through the buffer below
+    bool reentrantNthValues() const { return false; }
+
+private:
+    std::string buffer;
 };
 
 class FromQueue
@@ -68,7 +570,7 @@ public:
     typedef DataQueue::value_type value_type;
     
     explicit FromQueue(DataQueue* queue)
-    :queue_(queue)
+    :queue_(queue), stamp_(0)
     {
     }
     
@@ -76,11 +578,22 @@ public:
     {
       DataQueue::value_type val;
       queue_->getAnyValue(val);
+      stamp_ = queue_->pushTimestamp();
       return val;
     }
+
+    // the push stamp of the value returned last
+    LatencyClock::Ticks timestamp() const { return stamp_; }
     
 private:
     DataQueue* queue_;
+    LatencyClock::Ticks stamp_;
+};
+
+template<>
+struct TimestampSourceTraits<FromQueue>
+{
+    static LatencyClock::Ticks timestamp(FromQueue& source) { return source.timestamp(); }
 };
 
 class FromDefault
@@ -89,28 +602,54 @@ public:
     typedef DataQueue::value_type value_type;
     
     FromDefault()
-    : defaultValue()
+    : defaultValue(), generation_(0)
     {
     }
     explicit FromDefault(const value_type& value)
-    : defaultValue(value)
+    : defaultValue(value), generation_(0)
     {
     }
     
     void setValue(const value_type& value)
     {
       defaultValue = value;
+      ++generation_;
     }
 
     value_type getNextValue()
     {
         return defaultValue;
     }
+
+    // counts the setValue() calls
+    const unsigned long& generation() const { return generation_; }
     
 private:
     value_type  defaultValue;    
+    unsigned long  generation_;
+};
+
+template<>
+struct ConstantSourceTraits<FromDefault>
+{
+    static const unsigned long* generation(FromDefault& source) { return &source.generation(); }
 };
 
+// Off unless set: where nodes sit in arenas the hardware prefetcher
+// mostly keeps up; see DISABLED_PrefetchDistance for a given machine.
+const size_t DefaultPrefetchDistance = 0;
+
+// setPrefetchDistance() for a loop over nodes and their data addresses
+template<typename Node>
+void prefetchNodes(std::vector<Node> const& nodes, std::vector<const void*> const& addresses,
+                   size_t i, size_t distance)
+{
+    if(i + 2*distance < nodes.size())
+      prefetchAddress(&*nodes[i + 2*distance]);
+    if(i + distance < addresses.size())
+      prefetchAddress(addresses[i + distance]);
+}
+
 template<typename ValueType>
 class BitSetValue : public FieldValueBase<ValueType>
 {
@@ -121,12 +660,11 @@ public:
   struct IllegalSize : public std::exception {};
 
 private:
-  typedef boost::dynamic_bitset<unsigned char> DynamicBitset;
   typedef std::pair<size_t, FieldValueBase_ptr> SizeAndField;
 
 public:
   BitSetValue(std::size_t numBytes)
-    :byteCount(numBytes)
+    :byteCount(numBytes), encodeAll(false), latencies(0), prefetchDistance(DefaultPrefetchDistance)
   {
   }
 
@@ -141,35 +679,152 @@ public:
   {
     bits.push_back(std::make_pair(numBits, fv));
     checkSize();
+    text.resize(text.size() + numBits, '0');
+    encodedVersions.push_back(0);
+    dirty.resize(bits.size());
+    delta.addField(numBits);
+    generations.push_back(0);
+    updateList.push_back(fv.get());
+    dataAddresses.push_back(fv->dataAddress());
+    updateAddresses.push_back(dataAddresses.back());
   }
 
-  void update()
+  // fields whose bits were re-encoded by the last serializeTo()
+  boost::dynamic_bitset<> const& dirtyFields() const { return dirty; }
+
+  // every serializeTo() records push-to-output latencies here, 0 stops it
+  void setLatencyHistogram(LatencyHistogram* histogram) { latencies = histogram; }
+
+  void recordLatencies(LatencyHistogram& histogram, LatencyClock::Ticks now)
+  {
+    for(size_t f=0; f<bits.size(); ++f)
+      bits[f].second->recordLatencies(histogram, now);
+  }
+
+  // field widths for a DeltaDecoder of serializeDeltaTo() records
+  std::vector<size_t> const& deltaFieldBits() const { return delta.fieldBits(); }
+
+  // writes a delta record of the fields changed since the previous one
+  void serializeDeltaTo(std::ostream& output)
   {
-    BOOST_FOREACH(SizeAndField saf, bits)
+    delta.beginRecord();
+    for(size_t f=0; f<bits.size(); ++f)
     {
-      saf.second->update();
+      unsigned long version = bits[f].second->changeVersion();
+      if(delta.hasChanged(f, version))
+        delta.setChanged(f, version, packedValue(bits[f].second->getValue()));
     }
+    delta.writeTo(output);
   }
 
-  void serializeTo(std::ostream& output)
+  void update()
   {
-    DynamicBitset dynBuf;
+    for(size_t i=0; i<updateList.size(); ++i)
+    {
+      if(prefetchDistance)
+        prefetchNodes(updateList, updateAddresses, i, prefetchDistance);
+      updateList[i]->update();
+    }
+  }
 
-    BOOST_FOREACH(SizeAndField const& saf, bits)
+  // Constant fields are dropped from update() and their bits stay encoded
+  // in the text buffer until their constant is set again.
+  void foldConstants()
+  {
+    updateList.clear();
+    updateAddresses.clear();
+    for(size_t f=0; f<bits.size(); ++f)
     {
-      boost::dynamic_bitset<> val(saf.first, boost::get<long>(saf.second->getValue()));
-      for(size_t i=0; i<val.size(); ++i)
+      bits[f].second->foldConstants();
+      generations[f] = bits[f].second->constantGeneration();
+      if(!generations[f])
       {
-        dynBuf.push_back(val[i]);
+        updateList.push_back(bits[f].second.get());
+        updateAddresses.push_back(dataAddresses[f]);
       }
     }
-    output << dynBuf;
+    encodeAll = true;
+  }
+
+  void setUpdateMode(UpdateMode mode)
+  {
+    BOOST_FOREACH(SizeAndField const& saf, bits)
+    {
+      saf.second->setUpdateMode(mode);
+    }
+  }
+
+  void setPrefetchDistance(size_t distance)
+  {
+    prefetchDistance = distance;
+    BOOST_FOREACH(SizeAndField const& saf, bits)
+    {
+      saf.second->setPrefetchDistance(distance);
+    }
+  }
+
+  unsigned long changeVersion()
+  {
+    unsigned long version = 0;
+    for(size_t f=0; f<bits.size(); ++f)
+    {
+      if(prefetchDistance)
+        prefetchField(f);
+      version += bits[f].second->changeVersion();
+    }
+    return version;
+  }
+
+  unsigned long knownVersion()
+  {
+    unsigned long version = 0;
+    for(size_t f=0; f<bits.size(); ++f)
+    {
+      unsigned long known = bits[f].second->knownVersion();
+      if(!known)
+        return 0;
+      version += known;
+    }
+    return version;
+  }
+
+  // Writes the bits of all fields like operator<< of a dynamic_bitset
+  // holding them in field order: the first field's bit 0 comes last.
+  // Only fields that changed since the previous call are re-encoded.
+  void serializeTo(std::ostream& output)
+  {
+    encodeText();
+    output.write(text.data(), text.size());
+    if(latencies)
+      recordLatencies(*latencies, LatencyClock::now());
+  }
+
+  // the text buffer is referenced, not copied
+  void serializeSegmentsTo(GatherOutput& output)
+  {
+    encodeText();
+    output.addReference(text.data(), text.size());
+    if(latencies)
+      recordLatencies(*latencies, LatencyClock::now());
   }
 
   void serializeNthValueTo(size_t,std::ostream &)
   {
   }
 
+  // one character per bit, whatever the values
+  size_t serializedSize()
+  {
+    return text.size();
+  }
+
+  size_t serializedNthSize(size_t)
+  {
+    return 0;
+  }
+
+  bool reentrantNthValues() const { return true; }
+
 private:
   struct GetBitSize
   {
@@ -179,6 +834,41 @@ private:
     }
   };
 
+  void encodeText()
+  {
+    std::string::iterator pos = text.end();
+
+    for(size_t f=0; f<bits.size(); ++f)
+    {
+      if(prefetchDistance)
+        prefetchField(f);
+      SizeAndField const& saf = bits[f];
+      unsigned long version = generations[f] ? *generations[f] : saf.second->changeVersion();
+      dirty[f] = encodeAll || (version != encodedVersions[f]);
+      if(!dirty[f])
+      {
+        pos -= saf.first;
+        continue;
+      }
+
+      unsigned long value = packedValue(saf.second->getValue());
+      for(size_t i=0; i<saf.first; ++i)
+      {
+        *--pos = (i < std::numeric_limits<unsigned long>::digits && (value >> i) & 1) ? '1' : '0';
+      }
+      encodedVersions[f] = version;
+    }
+    encodeAll = false;
+  }
+
+  void prefetchField(size_t f) const
+  {
+    if(f + 2*prefetchDistance < bits.size())
+      prefetchAddress(bits[f + 2*prefetchDistance].second.get());
+    if(f + prefetchDistance < bits.size())
+      prefetchAddress(dataAddresses[f + prefetchDistance]);
+  }
+
   void checkSize() const
   {
     size_t bitCount = 0;
@@ -189,6 +879,20 @@ private:
 
   std::size_t byteCount;
   std::vector<SizeAndField> bits;
+  std::string text;
+  // per field the change version, or for folded constants the
+  // generation, its bits were encoded with
+  std::vector<unsigned long> encodedVersions;
+  boost::dynamic_bitset<> dirty;
+  bool encodeAll;
+  DeltaEncoder delta;
+  std::vector<const unsigned long*> generations;
+  std::vector<FieldValueBase<ValueType>*> updateList;
+  // per field and per update list entry, for prefetching
+  std::vector<const void*> dataAddresses;
+  std::vector<const void*> updateAddresses;
+  LatencyHistogram* latencies;
+  size_t prefetchDistance;
 };
 
 template<typename ValueType>
@@ -199,11 +903,13 @@ public:
     typedef ValueType value_type;
     
     MultiFieldValue(size_t repeatCount)
-    :repeat(repeatCount)
+    :repeat(repeatCount), cacheBuf(&cache), cacheOutput(&cacheBuf), patchOutput(&patchBuf), latencies(0),
+     pool(0), parallelMin(0), prefetchDistance(DefaultPrefetchDistance)
     {
     }
 
     size_t repeatCount() const { return repeat; }
+    size_t fieldCount() const { return fields.size(); }
     
     void addField(FieldValueBase<value_type>* fv)
     {
@@ -213,45 +919,883 @@ public:
     void addField(FieldValueBase_ptr fv)
     {
         fields.push_back(fv);
+        encodedVersions.push_back(0);
+        dirty.resize(fields.size());
+        segmentEnds.clear();
+        delta.addField(std::numeric_limits<unsigned long>::digits);
+        generations.push_back(0);
+        updateList.push_back(fv.get());
+        dataAddresses.push_back(fv->dataAddress());
+        updateAddresses.push_back(dataAddresses.back());
     }
-    
-    void update()
+
+    // fields whose bytes were re-encoded by the last serialization
+    boost::dynamic_bitset<> const& dirtyFields() const { return dirty; }
+
+    // every serializeTo() records push-to-output latencies here, 0 stops it
+    void setLatencyHistogram(LatencyHistogram* histogram) { latencies = histogram; }
+
+    // Encodes the repetitions on the pool once there are at least
+    // minRepetitions of them, as long as all changed fields are
+    // reentrantNthValues(); 0 goes back to encoding on the calling thread.
+    // The bytes are the same either way.
+    void setParallel(TaskPool* taskPool, size_t minRepetitions = 1024)
     {
-        BOOST_FOREACH(FieldValueBase_ptr fv, fields)
-        {
-            fv->update();
-        }
+        pool = taskPool;
+        parallelMin = minRepetitions;
     }
 
-    void serializeTo(std::ostream& output)
+    void recordLatencies(LatencyHistogram& histogram, LatencyClock::Ticks now)
     {
-        for(size_t i=0; i<repeat; ++i)
+        for(size_t f=0; f<fields.size(); ++f)
+            fields[f]->recordLatencies(histogram, now);
+    }
+
+    // field widths for a DeltaDecoder of serializeDeltaTo() records
+    std::vector<size_t> const& deltaFieldBits() const { return delta.fieldBits(); }
+
+    // Writes a delta record of the fields changed since the previous one.
+    // Fields are sent once per record, not per repetition, as full longs;
+    // they must be leaf fields holding longs or interned strings.
+    void serializeDeltaTo(std::ostream& output)
+    {
+        delta.beginRecord();
+        for(size_t f=0; f<fields.size(); ++f)
         {
-            serializeNthValueTo(i, output);
+            unsigned long version = fields[f]->changeVersion();
+            if(delta.hasChanged(f, version))
+                delta.setChanged(f, version, packedValue(fields[f]->getValue()));
         }
+        delta.writeTo(output);
     }
     
-    void serializeNthValueTo(size_t index, std::ostream& output)
+    void update()
+    {
+        for(size_t i=0; i<updateList.size(); ++i)
+        {
+            if(prefetchDistance)
+                prefetchNodes(updateList, updateAddresses, i, prefetchDistance);
+            updateList[i]->update();
+        }
+    }
+
+    // Constant fields are dropped from update() and their bytes stay in
+    // the cache until their constant is set again.
+    void foldConstants()
+    {
+        updateList.clear();
+        updateAddresses.clear();
+        for(size_t f=0; f<fields.size(); ++f)
+        {
+            fields[f]->foldConstants();
+            generations[f] = fields[f]->constantGeneration();
+            if(!generations[f])
+            {
+                updateList.push_back(fields[f].get());
+                updateAddresses.push_back(dataAddresses[f]);
+            }
+        }
+        segmentEnds.clear();
+    }
+
+    void setUpdateMode(UpdateMode mode)
+    {
+        BOOST_FOREACH(FieldValueBase_ptr const& fv, fields)
+        {
+            fv->setUpdateMode(mode);
+        }
+    }
+
+    void setEncoding(FieldEncoding encoding)
+    {
+        BOOST_FOREACH(FieldValueBase_ptr const& fv, fields)
+        {
+            fv->setEncoding(encoding);
+        }
+    }
+
+    void setPrefetchDistance(size_t distance)
+    {
+        prefetchDistance = distance;
+        BOOST_FOREACH(FieldValueBase_ptr const& fv, fields)
+        {
+            fv->setPrefetchDistance(distance);
+        }
+    }
+
+    // Adds the packed values of all fields as the next row of a column
+    // batch with one column per field, a ForColumnEncoder or a
+    // GroupVarintColumnEncoder.
+    template<class Batch>
+    void appendRowTo(Batch& batch)
+    {
+        row.resize(fields.size());
+        for(size_t f=0; f<fields.size(); ++f)
+            row[f] = long(packedValue(fields[f]->getValue()));
+        batch.addRow(row.empty() ? 0 : &row[0]);
+    }
+
+    unsigned long changeVersion()
+    {
+        unsigned long version = 0;
+        for(size_t f=0; f<fields.size(); ++f)
+        {
+            if(prefetchDistance)
+                prefetchField(f);
+            version += fields[f]->changeVersion();
+        }
+        return version;
+    }
+
+    unsigned long knownVersion()
+    {
+        unsigned long version = 0;
+        for(size_t f=0; f<fields.size(); ++f)
+        {
+            unsigned long known = fields[f]->knownVersion();
+            if(!known)
+                return 0;
+            version += known;
+        }
+        return version;
+    }
+
+    void serializeTo(std::ostream& output)
+    {
+        refreshCache();
+        output.write(cache.data(), cache.size());
+        if(latencies)
+            recordLatencies(*latencies, LatencyClock::now());
+    }
+
+    // The cache is referenced, not copied.  Fields that changed without
+    // changing size were re-encoded in place, so the bytes of the others
+    // were not copied either.
+    void serializeSegmentsTo(GatherOutput& output)
+    {
+        refreshCache();
+        output.addReference(cache.data(), cache.size());
+        if(latencies)
+            recordLatencies(*latencies, LatencyClock::now());
+    }
+    
+    // The sum over the fields, or the size of the cached bytes as long as
+    // no field changed since they were encoded.
+    size_t serializedSize()
+    {
+        if(cacheCurrent())
+            return cache.size();
+        size_t size = 0;
+        for(size_t i=0; i<repeat; ++i)
+            size += fieldsNthSize(i);
+        return size;
+    }
+
+    // Repetitions past the repeat count, asked for by an enclosing tree
+    // that repeats more often, are not cached and go to the fields.
+    size_t serializedNthSize(size_t index)
+    {
+        if(index >= repeat || !cacheCurrent())
+            return fieldsNthSize(index);
+        size_t first = index*fields.size();
+        size_t begin = first ? segmentEnds[first-1] : 0;
+        return fields.empty() ? 0 : segmentEnds[first+fields.size()-1] - begin;
+    }
+    
+    void serializeNthValueTo(size_t index, std::ostream& output)
     {
-        BOOST_FOREACH(FieldValueBase_ptr fv, fields)
+        if(index >= repeat)
         {
-            fv->serializeNthValueTo(index, output);
+            for(size_t f=0; f<fields.size(); ++f)
+                fields[f]->serializeNthValueTo(index, output);
+            return;
         }
+        refreshCache();
+        size_t first = index*fields.size();
+        size_t begin = first ? segmentEnds[first-1] : 0;
+        size_t end = fields.empty() ? begin : segmentEnds[first+fields.size()-1];
+        output.write(cache.data()+begin, end-begin);
     }
 
     private:
+    bool cacheCurrent()
+    {
+        if(segmentEnds.size() != repeat*fields.size())
+            return false;
+        for(size_t f=0; f<fields.size(); ++f)
+        {
+            if(prefetchDistance)
+                prefetchField(f);
+            if(fieldChanged(f))
+                return false;
+        }
+        return true;
+    }
+
+    // Whether the bytes of field f may differ from its cached ones; lazy
+    // fields are not pulled for it.  Generations of folded constants start
+    // at 0, known versions of the other fields do not.
+    bool fieldChanged(size_t f)
+    {
+        if(generations[f])
+            return *generations[f] != encodedVersions[f];
+        unsigned long version = fields[f]->knownVersion();
+        return !version || version != encodedVersions[f];
+    }
+
+    void prefetchField(size_t f) const
+    {
+        prefetchNodes(fields, dataAddresses, f, prefetchDistance);
+    }
+
+    size_t fieldsNthSize(size_t index)
+    {
+        size_t size = 0;
+        for(size_t f=0; f<fields.size(); ++f)
+            size += fields[f]->serializedNthSize(index);
+        return size;
+    }
+
+    /*
+     * The cache holds the serialized bytes of all repetitions, one segment
+     * per repetition and field.  Only dirty fields are encoded: in place if
+     * all their segments keep their sizes, otherwise into a new cache that
+     * the segments of fields that did not change are copied over to.
+     * Lazy fields with a pull pending count as dirty without being pulled;
+     * they pull when they encode, if their bytes depend on the value.
+     */
+    void refreshCache()
+    {
+        bool full = segmentEnds.size() != repeat*fields.size();
+        bool anyDirty = false;
+        for(size_t f=0; f<fields.size(); ++f)
+        {
+            if(prefetchDistance)
+                prefetchField(f);
+            dirty[f] = full || fieldChanged(f);
+            anyDirty = anyDirty || dirty[f];
+        }
+        if(!anyDirty && !full)
+            return;
+
+        if(full)
+            segmentEnds.assign(repeat*fields.size(), 0);
+        scratch.clear();
+        cacheBuf.setTarget(&scratch);
+        try
+        {
+            bool parallel = pool && repeat >= parallelMin && dirtyFieldsReentrant();
+            if(!full && !parallel && patchInPlace())
+            {
+                noteEncodedVersions();
+                return;
+            }
+            if(parallel)
+            {
+                // pulls and refolds happen here, the tasks only format
+                for(size_t f=0; f<fields.size(); ++f)
+                    if(dirty[f])
+                        fields[f]->changeVersion();
+                if(encodeParallel())
+                {
+                    cache.swap(scratch);
+                    noteEncodedVersions();
+                    return;
+                }
+                // a field wrote more than it sized, start over serially
+                segmentEnds.swap(oldEnds);
+                scratch.clear();
+            }
+            size_t oldBegin = 0;
+            size_t segment = 0;
+            for(size_t i=0; i<repeat; ++i)
+            {
+                for(size_t f=0; f<fields.size(); ++f, ++segment)
+                {
+                    size_t oldEnd = segmentEnds[segment];
+                    if(prefetchDistance)
+                        prefetchField(f);
+                    if(dirty[f])
+                        fields[f]->serializeNthValueTo(i, cacheOutput);
+                    else
+                        scratch.append(cache, oldBegin, oldEnd-oldBegin);
+                    oldBegin = oldEnd;
+                    segmentEnds[segment] = scratch.size();
+                }
+            }
+        }
+        catch(...)
+        {
+            segmentEnds.clear();
+            throw;
+        }
+        cache.swap(scratch);
+        noteEncodedVersions();
+    }
+
+    /*
+     * Overwrites the segments of the dirty fields in the cache if the new
+     * bytes have the sizes of the old ones.  Returns false if a size
+     * differs; segments patched by then hold the bytes the rebuild writes
+     * for them anyway.
+     */
+    bool patchInPlace()
+    {
+        size_t segment = 0;
+        for(size_t i=0; i<repeat; ++i)
+            for(size_t f=0; f<fields.size(); ++f, ++segment)
+                if(dirty[f] && fields[f]->serializedNthSize(i) != segmentSize(segment))
+                    return false;
+
+        // doubles are sized as an upper bound and may still come out shorter
+        segment = 0;
+        for(size_t i=0; i<repeat; ++i)
+        {
+            for(size_t f=0; f<fields.size(); ++f, ++segment)
+            {
+                if(!dirty[f])
+                    continue;
+                if(prefetchDistance)
+                    prefetchField(f);
+                size_t size = segmentSize(segment);
+                patchBuf.setSpan(size ? &cache[segmentEnds[segment] - size] : 0, size);
+                patchOutput.clear();
+                fields[f]->serializeNthValueTo(i, patchOutput);
+                if(!patchOutput || patchBuf.written() != size)
+                    return false;
+            }
+        }
+        return true;
+    }
+
+    size_t segmentSize(size_t segment) const
+    {
+        return segmentEnds[segment] - (segment ? segmentEnds[segment-1] : 0);
+    }
+
+    // after encoding, so that the versions of values pulled meanwhile count
+    void noteEncodedVersions()
+    {
+        for(size_t f=0; f<fields.size(); ++f)
+            if(dirty[f])
+                encodedVersions[f] = generations[f] ? *generations[f] : fields[f]->knownVersion();
+    }
+
+    bool dirtyFieldsReentrant() const
+    {
+        for(size_t f=0; f<fields.size(); ++f)
+            if(dirty[f] && !fields[f]->reentrantNthValues())
+                return false;
+        return true;
+    }
+
+    struct Chunk
+    {
+        Chunk()
+        :output(&buf)
+        {
+        }
+
+        SpanBuf buf;
+        std::ostream output;
+        size_t offset;
+        size_t size;
+    };
+
+    /*
+     * The repetitions are split into chunks.  The chunks are sized on the
+     * pool first, a prefix sum over the sizes gives each its slice of the
+     * new cache, and then they are encoded on the pool straight into their
+     * slices.  Doubles in text are sized as an upper bound; slices left
+     * with room over are moved together afterwards.  Returns false if a
+     * slice turned out too small.
+     */
+    bool encodeParallel()
+    {
+        size_t numChunks = std::min(repeat, (pool->threadCount() + 1) * 4);
+        while(chunks.size() < numChunks)
+            chunks.push_back(boost::shared_ptr<Chunk>(new Chunk));
+        oldEnds.swap(segmentEnds);
+        segmentEnds.resize(oldEnds.size());
+
+        pool->run(numChunks, [this, numChunks](size_t c) { sizeChunk(c, numChunks); });
+        size_t total = 0;
+        for(size_t c=0; c<numChunks; ++c)
+        {
+            chunks[c]->offset = total;
+            total += chunks[c]->size;
+        }
+        scratch.resize(total);
+
+        pool->run(numChunks, [this, numChunks](size_t c) { encodeChunk(c, numChunks); });
+        size_t end = 0;
+        for(size_t c=0; c<numChunks; ++c)
+        {
+            Chunk& chunk = *chunks[c];
+            if(!chunk.output)
+                return false;
+            if(chunk.offset != end)
+            {
+                std::memmove(&scratch[end], &scratch[chunk.offset], chunk.size);
+                size_t last = repeat*(c+1)/numChunks*fields.size();
+                for(size_t segment=repeat*c/numChunks*fields.size(); segment<last; ++segment)
+                    segmentEnds[segment] -= chunk.offset - end;
+            }
+            end += chunk.size;
+        }
+        scratch.resize(end);
+        return true;
+    }
+
+    void sizeChunk(size_t c, size_t numChunks)
+    {
+        size_t size = 0;
+        size_t end = repeat*(c+1)/numChunks;
+        for(size_t i=repeat*c/numChunks; i<end; ++i)
+        {
+            for(size_t f=0, segment=i*fields.size(); f<fields.size(); ++f, ++segment)
+            {
+                if(dirty[f])
+                    size += fields[f]->serializedNthSize(i);
+                else
+                    size += oldEnds[segment] - (segment ? oldEnds[segment-1] : 0);
+            }
+        }
+        chunks[c]->size = size;
+    }
+
+    // segment ends are set relative to the new cache
+    void encodeChunk(size_t c, size_t numChunks)
+    {
+        Chunk& chunk = *chunks[c];
+        char* slice = chunk.size ? &scratch[chunk.offset] : 0;
+        chunk.buf.setSpan(slice, chunk.size);
+        chunk.output.clear();
+        size_t end = repeat*(c+1)/numChunks;
+        for(size_t i=repeat*c/numChunks; i<end; ++i)
+        {
+            for(size_t f=0, segment=i*fields.size(); f<fields.size(); ++f, ++segment)
+            {
+                if(prefetchDistance)
+                    prefetchField(f);
+                if(dirty[f])
+                    fields[f]->serializeNthValueTo(i, chunk.output);
+                else
+                {
+                    size_t oldBegin = segment ? oldEnds[segment-1] : 0;
+                    chunk.output.write(cache.data() + oldBegin, oldEnds[segment]-oldBegin);
+                }
+                segmentEnds[segment] = chunk.offset + chunk.buf.written();
+            }
+        }
+        chunk.size = chunk.buf.written();
+    }
+
     size_t repeat;
     std::vector<FieldValueBase_ptr> fields;
+    // per field the change version, or for folded constants the
+    // generation, its cached bytes were encoded with
+    std::vector<unsigned long> encodedVersions;
+    boost::dynamic_bitset<> dirty;
+    std::string cache;
+    std::string scratch;
+    std::vector<size_t> segmentEnds;
+    StringAppendBuf cacheBuf;
+    std::ostream cacheOutput;
+    SpanBuf patchBuf;
+    std::ostream patchOutput;
+    DeltaEncoder delta;
+    std::vector<const unsigned long*> generations;
+    std::vector<FieldValueBase<ValueType>*> updateList;
+    // per field and per update list entry, for prefetching
+    std::vector<const void*> dataAddresses;
+    std::vector<const void*> updateAddresses;
+    std::vector<long> row;
+    LatencyHistogram* latencies;
+    TaskPool* pool;
+    size_t parallelMin;
+    std::vector<boost::shared_ptr<Chunk> > chunks;
+    std::vector<size_t> oldEnds;
+    size_t prefetchDistance;
+};
+
+/*
+ * Writes the record of the tree below it followed by the CRC-32C of that
+ * record as 4 bytes little endian.  The checksum is taken while the tree
+ * writes its bytes; as long as the tree's changeVersion() stays the same
+ * its bytes do too, and the checksum of the previous record is reused.
+ */
+template<typename ValueType>
+class ChecksumValue : public FieldValueBase<ValueType>
+{
+public:
+    typedef boost::shared_ptr<FieldValueBase<ValueType> > FieldValueBase_ptr;
+    typedef ValueType value_type;
+
+    explicit ChecksumValue(FieldValueBase<ValueType>* tree)
+    :child(tree), crcOutput(&crcBuf), checksummed(false), checksumVersion(0), crc(0)
+    {
+    }
+
+    explicit ChecksumValue(FieldValueBase_ptr tree)
+    :child(tree), crcOutput(&crcBuf), checksummed(false), checksumVersion(0), crc(0)
+    {
+    }
+
+    // the checksum of the last record written
+    boost::uint32_t checksum() const { return crc; }
+
+    void update() { child->update(); }
+    void setUpdateMode(UpdateMode mode) { child->setUpdateMode(mode); }
+    void setPrefetchDistance(size_t distance) { child->setPrefetchDistance(distance); }
+    const void* dataAddress() const { return child.get(); }
+    void setEncoding(FieldEncoding encoding) { child->setEncoding(encoding); }
+    unsigned long changeVersion() { return child->changeVersion(); }
+    unsigned long knownVersion() { return child->knownVersion(); }
+    void foldConstants() { child->foldConstants(); }
+
+    void recordLatencies(LatencyHistogram& histogram, LatencyClock::Ticks now)
+    {
+      child->recordLatencies(histogram, now);
+    }
+
+    void serializeTo(std::ostream& output)
+    {
+      unsigned long version = child->changeVersion();
+      if(checksummed && version == checksumVersion)
+        child->serializeTo(output);
+      else
+      {
+        crc = checksumOf(output, version, 0);
+        checksummed = true;
+      }
+      writeChecksum(output);
+    }
+
+    void serializeNthValueTo(size_t index, std::ostream& output)
+    {
+      crc = checksumOf(output, 0, &index);
+      checksummed = false;
+      writeChecksum(output);
+    }
+
+    size_t serializedSize() { return child->serializedSize() + 4; }
+    size_t serializedNthSize(size_t index) { return child->serializedNthSize(index) + 4; }
+
+private:
+    ChecksumValue(ChecksumValue const&);
+    ChecksumValue& operator=(ChecksumValue const&);
+
+    boost::uint32_t checksumOf(std::ostream& output, unsigned long version, const size_t* index)
+    {
+      crcBuf.setTarget(output.rdbuf());
+      crcBuf.reset();
+      if(index)
+        child->serializeNthValueTo(*index, crcOutput);
+      else
+        child->serializeTo(crcOutput);
+      checksumVersion = version;
+      return crcBuf.checksum();
+    }
+
+    void writeChecksum(std::ostream& output)
+    {
+      char bytes[4];
+      for(int i=0; i<4; ++i)
+        bytes[i] = char(crc >> (8*i));
+      output.write(bytes, sizeof(bytes));
+    }
+
+    FieldValueBase_ptr child;
+    Crc32cStreamBuf crcBuf;
+    std::ostream crcOutput;
+    bool checksummed;
+    unsigned long checksumVersion;
+    boost::uint32_t crc;
 };
 
 typedef FieldValue<FromDefault> FieldValueDefault;
 typedef FieldValue<FromQueue> FieldValueFromInput;
+typedef TlvFieldValue<FromQueue> TlvFieldValueFromInput;
+
+/*
+ * Builds field trees from schemas (see schema.h) with queues bound by
+ * name.  Each tree gets arenas holding its nodes, their shared_ptr
+ * control blocks, sources and constants; the arenas live as long as any
+ * copy of the returned root.  Fields reading the same queue share one
+ * FromQueue.
+ *
+ * PreorderLayout puts everything into one arena in the order it is
+ * built, each node followed by its subtree.  CacheLineLayout creates the
+ * children of a node back to back, starting on a cache line, before the
+ * children of any of them, so a node's loop over its fields walks
+ * adjacent memory.  Sources, constants and control blocks, which the
+ * loops reach only through pointers or not at all, go to a second arena
+ * and do not break up the runs of nodes.
+ */
+enum NodeLayout
+{
+    PreorderLayout,
+    CacheLineLayout
+};
+
+class SchemaLoader
+{
+public:
+    typedef DataQueue::value_type value_type;
+    typedef boost::shared_ptr<FieldValueBase<value_type> > FieldValueBase_ptr;
+
+    SchemaLoader()
+    :layout(PreorderLayout)
+    {
+    }
+
+    void setNodeLayout(NodeLayout nodeLayout) { layout = nodeLayout; }
+
+    void bindQueue(std::string const& name, DataQueue* queue)
+    {
+      queues[name] = queue;
+    }
+
+    FieldValueBase_ptr load(std::string const& text) const
+    {
+      return build(SchemaParser::parse(text));
+    }
+
+    FieldValueBase_ptr build(SchemaDescription const& schema) const
+    {
+      return build(schema.nodes.empty() ? 0 : &schema.nodes[0], schema.nodes.size(),
+                   schema.names.data(), schema.names.size());
+    }
+
+    FieldValueBase_ptr build(SchemaImage const& image) const
+    {
+      return build(image.nodes(), image.nodeCount(), image.names(), image.namesSize());
+    }
+
+    // Builds from nodes as SchemaParser produces them.  Only the bounds of
+    // child counts and names are checked; a schema parsed once need not be
+    // validated again.
+    FieldValueBase_ptr build(const SchemaNode* nodes, size_t count,
+                             const char* names, size_t namesSize) const
+    {
+      boost::shared_ptr<TreeArenas> arenas(new TreeArenas);
+      bool split = layout == CacheLineLayout;
+      Builder builder(*this, arenas->nodes, split ? arenas->cold : arenas->nodes,
+                      nodes, count, names, namesSize);
+      FieldValueBase_ptr root = split ? builder.buildSiblingsFirst() : builder.buildNode();
+      if(builder.next != count)
+        throw SchemaError("nodes after the top level node");
+      return FieldValueBase_ptr(arenas, root.get());
+    }
+
+private:
+    struct TreeArenas
+    {
+        // declared first so that it goes last, the nodes release their
+        // children through the control blocks kept here
+        NodeArena cold;
+        NodeArena nodes;
+    };
+
+    class Builder
+    {
+    public:
+        Builder(SchemaLoader const& schemaLoader, NodeArena& nodeArena, NodeArena& coldArena,
+                const SchemaNode* schemaNodes, size_t nodeCount, const char* schemaNames, size_t namesSize)
+        :next(0), loader(schemaLoader), arena(nodeArena), cold(coldArena), nodes(schemaNodes),
+         count(nodeCount), names(schemaNames), namesEnd(namesSize)
+        {
+        }
+
+        // the subtree at next, in preorder
+        FieldValueBase_ptr buildNode()
+        {
+          if(next == count)
+            throw SchemaError("missing child node");
+          size_t index = next++;
+          FieldValueBase_ptr result = createNode(nodes[index]);
+          for(boost::uint32_t c=0; c<childCount(nodes[index]); ++c)
+          {
+            size_t child = next;
+            addChild(nodes[index], result, child, buildNode());
+          }
+          return result;
+        }
+
+        // the whole tree, each node's children created in one run
+        FieldValueBase_ptr buildSiblingsFirst()
+        {
+          if(next == count)
+            throw SchemaError("missing child node");
+          arena.alignTo(NodeArena::CacheLineSize);
+          FieldValueBase_ptr root = createNode(nodes[next]);
+          next = buildChildren(next, root);
+          return root;
+        }
+
+        size_t next;
+
+    private:
+        static boost::uint32_t childCount(SchemaNode const& node)
+        {
+          return node.kind == SchemaMulti || node.kind == SchemaBits ? node.children : 0;
+        }
+
+        // Creates the children of the node at index, then their subtrees;
+        // returns the index after the subtree of the node.
+        size_t buildChildren(size_t index, FieldValueBase_ptr const& parent)
+        {
+          boost::uint32_t numChildren = childCount(nodes[index]);
+          if(!numChildren)
+            return index + 1;
+          std::vector<std::pair<size_t, FieldValueBase_ptr> > children;
+          arena.alignTo(NodeArena::CacheLineSize);
+          size_t child = index + 1;
+          for(boost::uint32_t c=0; c<numChildren; ++c)
+          {
+            if(child >= count)
+              throw SchemaError("missing child node");
+            FieldValueBase_ptr built = createNode(nodes[child]);
+            addChild(nodes[index], parent, child, built);
+            if(childCount(nodes[child]))
+              children.push_back(std::make_pair(child, built));
+            child = subtreeEnd(child);
+          }
+          size_t end = child;
+          for(size_t c=0; c<children.size(); ++c)
+            buildChildren(children[c].first, children[c].second);
+          return end;
+        }
+
+        size_t subtreeEnd(size_t index) const
+        {
+          for(size_t pending = 1; pending; --pending, ++index)
+          {
+            if(index >= count)
+              throw SchemaError("missing child node");
+            pending += childCount(nodes[index]);
+          }
+          return index;
+        }
+
+        void addChild(SchemaNode const& node, FieldValueBase_ptr const& parent,
+                      size_t child, FieldValueBase_ptr const& built)
+        {
+          if(node.kind == SchemaMulti)
+            static_cast<MultiFieldValue<value_type>*>(parent.get())->addField(built);
+          else
+            static_cast<BitSetValue<value_type>*>(parent.get())->addBits(nodes[child].bits, built);
+        }
+
+        // the node alone, without its children
+        FieldValueBase_ptr createNode(SchemaNode const& node)
+        {
+          switch(node.kind)
+          {
+          case SchemaMulti:
+            return share(arena.create<MultiFieldValue<value_type> >(size_t(node.size)));
+          case SchemaBits:
+            return share(arena.create<BitSetValue<value_type> >(size_t(node.size)));
+          case SchemaField:
+            {
+              FieldValue<FromQueue>* field = arena.create<FieldValue<FromQueue> >(source(node));
+              field->setEncoding(FieldEncoding(node.encoding));
+              return share(field);
+            }
+          case SchemaTlv:
+            return share(arena.create<TlvFieldValue<FromQueue> >(source(node)));
+          case SchemaConstLong:
+            return constant(value_type(long(node.constant)));
+          case SchemaConstDouble:
+            {
+              double number;
+              std::memcpy(&number, &node.constant, sizeof(number));
+              return constant(value_type(number));
+            }
+          }
+          throw SchemaError("unknown node kind");
+        }
+
+        template<typename Node>
+        FieldValueBase_ptr share(Node* node)
+        {
+          return FieldValueBase_ptr(node, ArenaNoDelete(), ArenaAllocator<Node>(cold));
+        }
+
+        FieldValueBase_ptr constant(value_type const& value)
+        {
+          FromDefault& source = *cold.create<FromDefault>(value);
+          return share(arena.create<FieldValueDefault>(source));
+        }
+
+        FromQueue& source(SchemaNode const& node)
+        {
+          if(node.nameOffset > namesEnd || node.nameLength > namesEnd - node.nameOffset)
+            throw SchemaError("bad queue name");
+          std::string name(names + node.nameOffset, node.nameLength);
+          FromQueue*& shared = sources[name];
+          if(!shared)
+          {
+            std::unordered_map<std::string, DataQueue*>::const_iterator it = loader.queues.find(name);
+            if(it == loader.queues.end())
+              throw SchemaError("unbound queue " + name);
+            shared = cold.create<FromQueue>(it->second);
+          }
+          return *shared;
+        }
+
+        SchemaLoader const& loader;
+        NodeArena& arena;
+        NodeArena& cold;
+        const SchemaNode* nodes;
+        size_t count;
+        const char* names;
+        size_t namesEnd;
+        std::unordered_map<std::string, FromQueue*> sources;
+    };
+
+    std::unordered_map<std::string, DataQueue*> queues;
+    NodeLayout layout;
+};
 
-const ::testing::TestInfo* const get_test_info()
-{
+const ::testing::TestInfo* const get_test_info()
+{
   return ::testing::UnitTest::GetInstance()->current_test_info();
 }
 
+// Runs update() and serializeTo() on the tree until it is warmed up and
+// then fails if any further round allocates.  Succeeds trivially unless
+// built with FIELDVALUE_TRACK_ALLOCATIONS.
+template<typename ValueType>
+::testing::AssertionResult NoSteadyStateAllocations(FieldValueBase<ValueType>& tree,
+                                                     size_t warmupRounds = 2,
+                                                     size_t rounds = 16)
+{
+  NullStreamBuf nullBuf;
+  std::ostream output(&nullBuf);
+
+  for(size_t i=0; i<warmupRounds; ++i)
+  {
+    tree.update();
+    tree.serializeTo(output);
+  }
+
+  for(size_t i=0; i<rounds; ++i)
+  {
+    AllocationStats updateStats = allocationsPerUpdate(tree);
+    AllocationStats serializeStats = allocationsPerSerialize(tree, output);
+    if(updateStats.allocations || serializeStats.allocations)
+    {
+      return ::testing::AssertionFailure(::testing::Message()
+        << "round " << i << " allocated: update() "
+        << updateStats.allocations << " times (" << updateStats.bytes << " bytes), serializeTo() "
+        << serializeStats.allocations << " times (" << serializeStats.bytes << " bytes)");
+    }
+  }
+  return ::testing::AssertionSuccess();
+}
+
 TEST(FieldValueTest, Default)
 {
     DataQueue::value_type value;
@@ -306,11 +1850,12 @@ TEST(FieldValueTest, MultiFieldsNoRepeat)
 
     MultiFieldValue<DataQueue::value_type> single(1);
     ASSERT_EQ(1, single.repeatCount());
-    single.addField(new FieldValueFromInput(FromQueue(&dataQueue)));
+    FromQueue       fromQueue(&dataQueue);
+    single.addField(new FieldValueFromInput(fromQueue));
 
     single.update();
 
-    const ::testing::TestInfo* const test_info =
+    const ::testing::TestInfo* const test_info =
     ::testing::UnitTest::GetInstance()->current_test_info();
     std::string ofname(test_info->name());
     ofname += ".out";
@@ -332,11 +1877,14 @@ TEST(FieldValueTest, MultiFieldsYesRepeat)
     MultiFieldValue<DataQueue::value_type> multi(numRepeat);
     ASSERT_EQ(numRepeat, multi.repeatCount());
 
+    std::vector<FromQueue> fromQueue;
     for(int i=0; i<5; ++i)
-        multi.addField(new FieldValueFromInput(FromQueue(&dataQueue[i+1])));
+        fromQueue.push_back(FromQueue(&dataQueue[i+1]));
+    for(int i=0; i<5; ++i)
+        multi.addField(new FieldValueFromInput(fromQueue[i]));
     multi.update();
 
-    const ::testing::TestInfo* const test_info = get_test_info();
+    const ::testing::TestInfo* const test_info = get_test_info();
     std::string ofname(test_info->name());
     ofname += ".out";
     std::ofstream output(ofname.c_str());
@@ -345,4 +1893,2168 @@ TEST(FieldValueTest, MultiFieldsYesRepeat)
     output << "\n---------------------\n";
 }
 
+TEST(FieldValueTest, BitsetSerialize)
+{
+    BitSetValue<DataQueue::value_type> bitsetValue(2);
+    FromDefault five(DataQueue::value_type(long(5)));
+    FromDefault one(DataQueue::value_type(long(1)));
+    FromDefault minusOne(DataQueue::value_type(long(-1)));
+    bitsetValue.addBits(3, new FieldValueDefault(five));
+    bitsetValue.addBits(2, new FieldValueDefault(one));
+    bitsetValue.addBits(4, new FieldValueDefault(minusOne));
+    bitsetValue.update();
+
+    std::ostringstream output;
+    bitsetValue.serializeTo(output);
+    EXPECT_EQ("111101101", output.str());
+}
+
+class CountingSource
+{
+public:
+    typedef DataQueue::value_type value_type;
+
+    CountingSource()
+    :pulls(0)
+    {
+    }
+
+    value_type getNextValue()
+    {
+      return value_type(long(++pulls));
+    }
+
+    long pulls;
+};
+
+TEST(FieldValueTest, DirtyTracking)
+{
+    DataQueue       dataQueue[3];
+    std::vector<FromQueue> fromQueue;
+    for(size_t i=0; i<3; ++i)
+    {
+      dataQueue[i].push(DataQueue::value_type(long(i+1)));
+      fromQueue.push_back(FromQueue(&dataQueue[i]));
+    }
+
+    boost::shared_ptr<FieldValueFromInput> first(new FieldValueFromInput(fromQueue[0]));
+    MultiFieldValue<DataQueue::value_type> multi(2);
+    multi.addField(first);
+    multi.addField(new FieldValueFromInput(fromQueue[1]));
+    multi.addField(new FieldValueFromInput(fromQueue[2]));
+
+    multi.update();
+    unsigned long version = first->changeVersion();
+    std::ostringstream output;
+    multi.serializeTo(output);
+    EXPECT_EQ("(0,1)(0,2)(0,3)(1,1)(1,2)(1,3)", output.str());
+    EXPECT_EQ(3u, multi.dirtyFields().count());
+
+    multi.update();
+    EXPECT_EQ(version, first->changeVersion());
+    output.str("");
+    multi.serializeTo(output);
+    EXPECT_EQ("(0,1)(0,2)(0,3)(1,1)(1,2)(1,3)", output.str());
+    EXPECT_TRUE(multi.dirtyFields().none());
+
+    // a change that is overwritten by an equal value before serialization
+    // must still be seen
+    dataQueue[1].push(DataQueue::value_type(long(20)));
+    multi.update();
+    dataQueue[1].push(DataQueue::value_type(long(2)));
+    dataQueue[2].push(DataQueue::value_type(long(30)));
+    multi.update();
+    output.str("");
+    multi.serializeNthValueTo(1, output);
+    EXPECT_EQ("(1,1)(1,2)(1,30)", output.str());
+    EXPECT_FALSE(multi.dirtyFields()[0]);
+    EXPECT_TRUE(multi.dirtyFields()[2]);
+
+    BitSetValue<DataQueue::value_type> bitsetValue(1);
+    bitsetValue.addBits(4, new FieldValueFromInput(fromQueue[0]));
+    bitsetValue.addBits(4, new FieldValueFromInput(fromQueue[1]));
+    bitsetValue.update();
+    output.str("");
+    bitsetValue.serializeTo(output);
+    EXPECT_EQ("00100001", output.str());
+
+    dataQueue[0].push(DataQueue::value_type(long(5)));
+    bitsetValue.update();
+    output.str("");
+    bitsetValue.serializeTo(output);
+    EXPECT_EQ("00100101", output.str());
+    EXPECT_TRUE(bitsetValue.dirtyFields()[0]);
+    EXPECT_FALSE(bitsetValue.dirtyFields()[1]);
+}
+
+TEST(FieldValueTest, NestedRepeat)
+{
+    FromDefault one(DataQueue::value_type(long(1)));
+    FromDefault two(DataQueue::value_type(long(2)));
+    MultiFieldValue<DataQueue::value_type>* inner = new MultiFieldValue<DataQueue::value_type>(1);
+    inner->addField(new FieldValueDefault(one));
+    inner->addField(new FieldValueDefault(two));
+    MultiFieldValue<DataQueue::value_type> outer(3);
+    outer.addField(inner);
+    outer.update();
+
+    EXPECT_EQ(30u, outer.serializedSize());
+    std::ostringstream output;
+    outer.serializeTo(output);
+    EXPECT_EQ("(0,1)(0,2)(1,1)(1,2)(2,1)(2,2)", output.str());
+    EXPECT_EQ(10u, inner->serializedNthSize(2));
+    EXPECT_EQ(30u, outer.serializedSize());
+
+    output.str("");
+    outer.serializeNthValueTo(2, output);
+    EXPECT_EQ("(2,1)(2,2)", output.str());
+
+    // the inner tree's own repetition still comes from its cache
+    output.str("");
+    inner->serializeTo(output);
+    EXPECT_EQ("(0,1)(0,2)", output.str());
+    output.str("");
+    outer.serializeTo(output);
+    EXPECT_EQ("(0,1)(0,2)(1,1)(1,2)(2,1)(2,2)", output.str());
+}
+
+TEST(FieldValueTest, LazyUpdate)
+{
+    CountingSource sources[4];
+    MultiFieldValue<DataQueue::value_type> multi(2);
+    multi.addField(new FieldValue<CountingSource>(sources[0]));
+    multi.addField(new FieldValue<CountingSource>(sources[1]));
+
+    boost::shared_ptr<BitSetValue<DataQueue::value_type> > bitsetValue(
+      new BitSetValue<DataQueue::value_type>(1));
+    bitsetValue->addBits(4, new FieldValue<CountingSource>(sources[2]));
+    bitsetValue->addBits(4, new FieldValue<CountingSource>(sources[3]));
+    bitsetValue->setUpdateMode(LazyUpdate);
+    multi.addField(bitsetValue);
+
+    multi.update();
+    EXPECT_EQ(1, sources[0].pulls);
+    EXPECT_EQ(1, sources[1].pulls);
+    EXPECT_EQ(0, sources[2].pulls);
+    EXPECT_EQ(0, sources[3].pulls);
+
+    multi.setUpdateMode(LazyUpdate);
+    multi.update();
+    multi.update();
+    EXPECT_EQ(1, sources[0].pulls);
+
+    std::ostringstream output;
+    multi.serializeNthValueTo(0, output);
+    EXPECT_EQ("(0,2)(0,2)", output.str());
+    EXPECT_EQ(0, sources[2].pulls);
+
+    bitsetValue->serializeTo(output);
+    bitsetValue->serializeTo(output);
+    EXPECT_EQ(1, sources[2].pulls);
+    EXPECT_EQ(1, sources[3].pulls);
+    EXPECT_EQ("(0,2)(0,2)0001000100010001", output.str());
+}
+
+TEST(FieldValueTest, DeltaEncoding)
+{
+    DataQueue       dataQueue[3];
+    std::vector<FromQueue> fromQueue;
+    for(size_t i=0; i<3; ++i)
+    {
+      dataQueue[i].push(DataQueue::value_type(long(i+1)));
+      fromQueue.push_back(FromQueue(&dataQueue[i]));
+    }
+
+    MultiFieldValue<DataQueue::value_type> multi(4);
+    for(size_t i=0; i<3; ++i)
+      multi.addField(new FieldValueFromInput(fromQueue[i]));
+    DeltaDecoder multiDecoder(multi.deltaFieldBits());
+
+    std::ostringstream output;
+    multi.update();
+    multi.serializeDeltaTo(output);
+    EXPECT_EQ(1u + 3*sizeof(long), output.str().size());
+    EXPECT_EQ(output.str().size(), multiDecoder.decode(output.str().data(), output.str().size()));
+    EXPECT_EQ(1, multiDecoder.values()[0]);
+    EXPECT_EQ(3, multiDecoder.values()[2]);
+
+    dataQueue[1].push(DataQueue::value_type(long(-7)));
+    multi.update();
+    output.str("");
+    multi.serializeDeltaTo(output);
+    EXPECT_EQ(1u + sizeof(long), output.str().size());
+    EXPECT_EQ(char(0x02), output.str()[0]);
+    multiDecoder.decode(output.str().data(), output.str().size());
+    EXPECT_EQ(1u, multiDecoder.changedFields().count());
+    EXPECT_EQ(1, multiDecoder.values()[0]);
+    EXPECT_EQ(-7, multiDecoder.values()[1]);
+    EXPECT_EQ(3, multiDecoder.values()[2]);
+
+    multi.update();
+    output.str("");
+    multi.serializeDeltaTo(output);
+    EXPECT_EQ(std::string(1, '\0'), output.str());
+
+    BitSetValue<DataQueue::value_type> bitsetValue(2);
+    bitsetValue.addBits(3, new FieldValueFromInput(fromQueue[0]));
+    bitsetValue.addBits(5, new FieldValueFromInput(fromQueue[1]));
+    bitsetValue.addBits(4, new FieldValueFromInput(fromQueue[2]));
+    DeltaDecoder bitsetDecoder(bitsetValue.deltaFieldBits());
+
+    bitsetValue.update();
+    output.str("");
+    bitsetValue.serializeDeltaTo(output);
+    // bitmap 0b111, then 001 11001 0011
+    ASSERT_EQ(3u, output.str().size());
+    EXPECT_EQ(char(0x07), output.str()[0]);
+    EXPECT_EQ(char(0xc9), output.str()[1]);
+    EXPECT_EQ(char(0x03), output.str()[2]);
+
+    bitsetDecoder.decode(output.str().data(), output.str().size());
+    EXPECT_EQ(25, bitsetDecoder.values()[1]);
+
+    output.str("");
+    dataQueue[2].push(DataQueue::value_type(long(9)));
+    bitsetValue.update();
+    bitsetValue.serializeDeltaTo(output);
+    bitsetValue.update();
+    dataQueue[0].push(DataQueue::value_type(long(6)));
+    bitsetValue.update();
+    bitsetValue.serializeDeltaTo(output);
+    std::string stream = output.str();
+    EXPECT_EQ(4u, stream.size());
+
+    size_t used = bitsetDecoder.decode(stream.data(), stream.size());
+    EXPECT_EQ(1, bitsetDecoder.values()[0]);
+    EXPECT_EQ(9, bitsetDecoder.values()[2]);
+    bitsetDecoder.decode(stream.data()+used, stream.size()-used);
+    EXPECT_EQ(6, bitsetDecoder.values()[0]);
+    EXPECT_EQ(25, bitsetDecoder.values()[1]);
+    EXPECT_EQ(9, bitsetDecoder.values()[2]);
+
+    EXPECT_THROW(bitsetDecoder.decode(stream.data(), 1), DeltaDecoder::Truncated);
+}
+
+TEST(FieldValueTest, ConstantFolding)
+{
+    FromDefault header(DataQueue::value_type(long(5)));
+    FromDefault label(DataQueue::value_type(std::string("unused")));
+    DataQueue       dataQueue;
+    dataQueue.push(DataQueue::value_type(long(2)));
+    FromQueue       fromQueue(&dataQueue);
+
+    boost::shared_ptr<FieldValueDefault> constant(new FieldValueDefault(header));
+    BitSetValue<DataQueue::value_type> bitsetValue(1);
+    bitsetValue.addBits(3, constant);
+    bitsetValue.addBits(4, new FieldValueFromInput(fromQueue));
+    bitsetValue.foldConstants();
+    EXPECT_TRUE(constant->constantGeneration() != 0);
+    EXPECT_EQ(0, bitsetValue.constantGeneration());
+
+    MultiFieldValue<DataQueue::value_type> multi(2);
+    multi.addField(new FieldValueDefault(header));
+    multi.addField(new FieldValueFromInput(fromQueue));
+    multi.foldConstants();
+
+    // constants without a pre-encoded form are serialized as before
+    MultiFieldValue<DataQueue::value_type> labelled(1);
+    labelled.addField(new FieldValueDefault(label));
+    EXPECT_NO_THROW(labelled.foldConstants());
+
+    std::ostringstream output;
+    labelled.serializeTo(output);
+    EXPECT_EQ("(0,unused)", output.str());
+    output.str("");
+
+    bitsetValue.update();
+    bitsetValue.serializeTo(output);
+    EXPECT_EQ("0010101", output.str());
+
+    output.str("");
+    multi.update();
+    multi.serializeTo(output);
+    EXPECT_EQ("(0,5)(0,2)(1,5)(1,2)", output.str());
+    multi.update();
+    multi.serializeTo(output);
+    EXPECT_TRUE(multi.dirtyFields().none());
+
+    header.setValue(DataQueue::value_type(long(3)));
+    dataQueue.push(DataQueue::value_type(long(4)));
+    output.str("");
+    bitsetValue.update();
+    bitsetValue.serializeTo(output);
+    EXPECT_EQ("0100011", output.str());
+    EXPECT_EQ(3, boost::get<long>(constant->getValue()));
+
+    output.str("");
+    multi.update();
+    multi.serializeTo(output);
+    EXPECT_EQ("(0,3)(0,4)(1,3)(1,4)", output.str());
+}
+
+TEST(FieldValueTest, TextEncoder)
+{
+    const long longs[] = { 0, 1, -1, 9, 10, -10, 99, 100, 101, 999, 1000,
+                           1234567890L, -987654321L,
+                           std::numeric_limits<long>::max(),
+                           std::numeric_limits<long>::min() };
+    char buf[TextEncoder::MaxChars];
+    for(size_t i=0; i<sizeof(longs)/sizeof(longs[0]); ++i)
+    {
+      std::ostringstream expected;
+      expected << longs[i];
+      EXPECT_EQ(expected.str(), std::string(buf, TextEncoder::formatLong(longs[i], buf)));
+    }
+    EXPECT_EQ("18446744073709551615",
+              std::string(buf, TextEncoder::formatUnsigned(std::numeric_limits<unsigned long>::max(), buf)));
+
+    const double doubles[] = { 0.0, 1.5, -2.25, 0.1, 1.0/3, 1e300, -4.9e-324, 123456789.0 };
+    for(size_t i=0; i<sizeof(doubles)/sizeof(doubles[0]); ++i)
+    {
+      std::string text(buf, TextEncoder::formatDouble(doubles[i], buf));
+      EXPECT_EQ(doubles[i], std::strtod(text.c_str(), 0)) << text;
+    }
+    EXPECT_EQ("0.1", std::string(buf, TextEncoder::formatDouble(0.1, buf)));
+
+    DataQueue       dataQueue;
+    FromQueue       fromQueue(&dataQueue);
+    FieldValueFromInput value(fromQueue);
+    std::ostringstream output;
+
+    dataQueue.push(DataQueue::value_type(long(-42)));
+    value.update();
+    value.serializeTo(output);
+    value.serializeNthValueTo(12, output);
+    EXPECT_EQ("-42(12,-42)", output.str());
+
+    dataQueue.push(DataQueue::value_type(2.5));
+    value.update();
+    output.str("");
+    value.serializeNthValueTo(0, output);
+    EXPECT_EQ("(0,2.5)", output.str());
+
+    BaseItemIDList list;
+    list.push_back(BaseItemID(1, BaseItem(long(10))));
+    list.push_back(BaseItemID(2, BaseItem(std::string("IBM"))));
+    list.push_back(BaseItemID(-3, BaseItem(0.5)));
+    dataQueue.push(DataQueue::value_type(list));
+    value.update();
+    output.str("");
+    value.serializeNthValueTo(1, output);
+    EXPECT_EQ("(1,[1:10;2:IBM;-3:0.5])", output.str());
+
+    dataQueue.push(DataQueue::value_type(list[0]));
+    value.update();
+    output.str("");
+    value.serializeTo(output);
+    EXPECT_EQ("1:10", output.str());
+
+    // short lists stay inside the QueueItem
+    list.pop_back();
+    dataQueue.push(DataQueue::value_type(list));
+    MultiFieldValue<DataQueue::value_type> multi(1);
+    multi.addField(new FieldValueFromInput(fromQueue));
+    EXPECT_TRUE(NoSteadyStateAllocations(multi));
+}
+
+TEST(FieldValueTest, StringInterning)
+{
+    StringTable     strings;
+    DataQueue       dataQueue[2];
+    dataQueue[0].setStringTable(&strings);
+    dataQueue[1].setStringTable(&strings);
+    FromQueue       fromQueue[2] = { FromQueue(&dataQueue[0]), FromQueue(&dataQueue[1]) };
+
+    dataQueue[0].push(DataQueue::value_type(std::string("IBM")));
+    dataQueue[1].push(DataQueue::value_type(std::string("IBM")));
+    InternedString first = boost::get<InternedString>(fromQueue[0].getNextValue());
+    InternedString second = boost::get<InternedString>(fromQueue[1].getNextValue());
+    EXPECT_EQ(first.id, second.id);
+    EXPECT_EQ(first.text, second.text);
+    EXPECT_EQ("IBM", *first.text);
+
+    dataQueue[1].push(DataQueue::value_type(std::string("MSFT")));
+    InternedString third = boost::get<InternedString>(fromQueue[1].getNextValue());
+    EXPECT_NE(first.id, third.id);
+    EXPECT_EQ(2u, strings.size());
+
+    MultiFieldValue<DataQueue::value_type> multi(2);
+    multi.addField(new FieldValueFromInput(fromQueue[0]));
+    multi.addField(new FieldValueFromInput(fromQueue[1]));
+    multi.update();
+    std::ostringstream output;
+    multi.serializeTo(output);
+    EXPECT_EQ("(0,IBM)(0,MSFT)(1,IBM)(1,MSFT)", output.str());
+
+    BitSetValue<DataQueue::value_type> bitsetValue(1);
+    bitsetValue.addBits(4, new FieldValueFromInput(fromQueue[0]));
+    bitsetValue.addBits(4, new FieldValueFromInput(fromQueue[1]));
+    bitsetValue.update();
+    output.str("");
+    bitsetValue.serializeTo(output);
+    EXPECT_EQ("00100001", output.str());
+
+    EXPECT_TRUE(NoSteadyStateAllocations(multi));
+}
+
+TEST(FieldValueTest, TlvFields)
+{
+    DataQueue       dataQueue;
+    FromQueue       fromQueue(&dataQueue);
+    TlvFieldValueFromInput value(fromQueue);
+    std::ostringstream output;
+
+    dataQueue.push(DataQueue::value_type(long(-2)));
+    value.update();
+    value.serializeTo(output);
+    EXPECT_EQ(std::string("\x01\x08\xfe\xff\xff\xff\xff\xff\xff\xff", 10), output.str());
+
+    BaseItemIDList list;
+    list.push_back(BaseItemID(300, BaseItem(long(1))));
+    list.push_back(BaseItemID(-1, BaseItem(std::string("IBM"))));
+    dataQueue.push(DataQueue::value_type(list));
+    value.update();
+    output.str("");
+    value.serializeTo(output);
+    const char expected[] =
+      "\x11\x17" "\x02"
+      "\xac\x02" "\x01\x08\x01\x00\x00\x00\x00\x00\x00\x00"
+      "\xff\xff\xff\xff\x0f" "\x03\x03IBM";
+    EXPECT_EQ(std::string(expected, sizeof(expected)-1), output.str());
+    EXPECT_EQ(output.str().size(), TlvEncoder::encodedSize(value.getValue()));
+
+    std::string bytes = output.str();
+    const char* pos = bytes.data();
+    QueueItem decoded = TlvDecoder::decode(pos, bytes.data()+bytes.size());
+    EXPECT_EQ(bytes.data()+bytes.size(), pos);
+    EXPECT_TRUE(decoded == value.getValue());
+
+    dataQueue.push(DataQueue::value_type(list[0]));
+    dataQueue.push(DataQueue::value_type(BaseItemID(7, BaseItem(0.25))));
+    value.update();
+    output.str("");
+    value.serializeNthValueTo(3, output);
+    bytes = output.str();
+    pos = bytes.data();
+    EXPECT_TRUE(TlvDecoder::decode(pos, bytes.data()+bytes.size()) == value.getValue());
+
+    pos = bytes.data();
+    EXPECT_THROW(TlvDecoder::decode(pos, bytes.data()+bytes.size()-1), TlvDecoder::Malformed);
+
+    // interned strings come back with their ids only, which tell them apart
+    StringTable strings;
+    dataQueue.setStringTable(&strings);
+    QueueItem interned[3];
+    const char* texts[3] = { "IBM", "MSFT", "IBM" };
+    for(size_t i=0; i<3; ++i)
+    {
+      dataQueue.push(DataQueue::value_type(std::string(texts[i])));
+      value.update();
+      output.str("");
+      value.serializeTo(output);
+      bytes = output.str();
+      pos = bytes.data();
+      interned[i] = TlvDecoder::decode(pos, bytes.data()+bytes.size());
+      EXPECT_TRUE(boost::get<InternedString>(interned[i]).text == 0);
+    }
+    EXPECT_FALSE(interned[0] == interned[1]);
+    EXPECT_TRUE(interned[0] == interned[2]);
+    EXPECT_FALSE(interned[0] == value.getValue());
+    dataQueue.setStringTable(0);
+
+    MultiFieldValue<DataQueue::value_type> multi(2);
+    multi.addField(new TlvFieldValueFromInput(fromQueue));
+    dataQueue.push(DataQueue::value_type(list));
+    EXPECT_TRUE(NoSteadyStateAllocations(multi));
+}
+
+TEST(FieldValueTest, VarintEncodings)
+{
+    DataQueue       dataQueue[8];
+    std::vector<FromQueue> fromQueue;
+    const long values[8] = { 0, 1, -1, 63, -64, 64, 300, -300 };
+    for(size_t i=0; i<8; ++i)
+    {
+      dataQueue[i].push(DataQueue::value_type(values[i]));
+      fromQueue.push_back(FromQueue(&dataQueue[i]));
+    }
+
+    FieldValueFromInput value(fromQueue[6]);
+    value.update();
+    std::ostringstream output;
+    value.setEncoding(VarintEncoding);
+    value.serializeNthValueTo(2, output);
+    EXPECT_EQ("\xac\x02", output.str());
+    output.str("");
+    value.setEncoding(FixedEncoding);
+    value.serializeTo(output);
+    EXPECT_EQ(std::string("\x2c\x01\0\0\0\0\0\0", 8), output.str());
+
+    MultiFieldValue<DataQueue::value_type> multi(2);
+    for(size_t i=0; i<8; ++i)
+      multi.addField(new FieldValueFromInput(fromQueue[i]));
+    multi.update();
+    multi.setEncoding(ZigZagEncoding);
+    output.str("");
+    multi.serializeNthValueTo(1, output);
+    EXPECT_EQ(std::string("\x00\x02\x01\x7e\x7f\x80\x01\xd8\x04\xd7\x04", 11), output.str());
+    for(size_t i=0; i<8; ++i)
+      EXPECT_EQ(values[i], ZigZag::decode(ZigZag::encode(values[i])));
+
+    std::string bytes = output.str();
+    const char* pos = bytes.data();
+    for(size_t i=0; i<8; ++i)
+      EXPECT_EQ(values[i], ZigZag::decode(Varint::decode(pos, bytes.data()+bytes.size())));
+
+    // four records of small counters against fixed 8-byte longs: the
+    // header, then per field a tag byte and its values in all records
+    GroupVarintColumnEncoder batch(multi.fieldCount());
+    for(long r=0; r<4; ++r)
+    {
+      for(size_t i=0; i<8; ++i)
+        dataQueue[i].push(DataQueue::value_type(values[i] + r));
+      multi.update();
+      multi.appendRowTo(batch);
+    }
+    EXPECT_EQ(4u, batch.rowCount());
+    output.str("");
+    batch.writeTo(output);
+    EXPECT_EQ(0u, batch.rowCount());
+    bytes = output.str();
+    EXPECT_EQ(2 + 6u*(1 + 4*1) + 2*(1 + 4*2), bytes.size());
+    EXPECT_GT(4u*8*8, 4*bytes.size());
+    pos = bytes.data();
+    const char* end = bytes.data()+bytes.size();
+    EXPECT_EQ(4u, Varint::decode(pos, end));
+    EXPECT_EQ(8u, Varint::decode(pos, end));
+    unsigned long decoded[8];
+    for(size_t i=0; i<8; ++i)
+    {
+      pos = GroupVarint::decode(pos, end, decoded, 4);
+      for(long r=0; r<4; ++r)
+        EXPECT_EQ(values[i] + r, ZigZag::decode(decoded[r]));
+    }
+    EXPECT_EQ(end, pos);
+    EXPECT_THROW(GroupVarint::decode(bytes.data()+2, bytes.data()+4, decoded, 4),
+                 GroupVarint::Truncated);
+
+    const unsigned long wide[5] = { 1, 0x1234, 0x12345678UL, 0x123456789aUL, 0 };
+    char buf[64];
+    end = GroupVarint::encode(wide, 5, buf);
+    EXPECT_EQ(2 + 1 + 2 + 4 + 8 + 1, end - buf);
+    GroupVarint::decode(buf, end, decoded, 5);
+    EXPECT_TRUE(std::equal(wide, wide+5, decoded));
+}
+
+TEST(FieldValueTest, FrameOfReferenceColumns)
+{
+    DataQueue       dataQueue[3];
+    std::vector<FromQueue> fromQueue;
+    for(size_t i=0; i<3; ++i)
+      fromQueue.push_back(FromQueue(&dataQueue[i]));
+
+    MultiFieldValue<DataQueue::value_type> multi(4);
+    for(size_t i=0; i<3; ++i)
+      multi.addField(new FieldValueFromInput(fromQueue[i]));
+
+    ForColumnEncoder batch(multi.fieldCount());
+    const long prices[5] = { 10050, 10052, 10049, 10057, 10050 };
+    for(size_t r=0; r<5; ++r)
+    {
+      dataQueue[0].push(DataQueue::value_type(prices[r]));
+      dataQueue[1].push(DataQueue::value_type(long(-3)));
+      dataQueue[2].push(DataQueue::value_type(long(r) - 2));
+      multi.update();
+      multi.appendRowTo(batch);
+    }
+    EXPECT_EQ(5u, batch.rowCount());
+
+    std::ostringstream output;
+    batch.writeTo(output);
+    EXPECT_EQ(0u, batch.rowCount());
+    std::string bytes = output.str();
+    // header 2, prices 3+1+3 (width 4), constant 1+1, offsets 1+1+2 (width 3)
+    EXPECT_EQ(2u + 7 + 2 + 4, bytes.size());
+
+    ForColumnDecoder decoder;
+    EXPECT_EQ(bytes.size(), decoder.decode(bytes.data(), bytes.size()));
+    ASSERT_EQ(3u, decoder.columns().size());
+    EXPECT_TRUE(std::equal(prices, prices+5, decoder.columns()[0].begin()));
+    EXPECT_TRUE(std::vector<long>(5, -3) == decoder.columns()[1]);
+    EXPECT_EQ(-2, decoder.columns()[2][0]);
+    EXPECT_EQ(2, decoder.columns()[2][4]);
+    EXPECT_THROW(decoder.decode(bytes.data(), bytes.size()-1), ForColumnDecoder::Truncated);
+    EXPECT_THROW(ForColumnDecoder(4).decode(bytes.data(), bytes.size()), ForColumnDecoder::Malformed);
+
+    // counts the input cannot hold fail before anything is sized by them
+    char header[2*Varint::MaxBytes];
+    std::string manyRows(header, Varint::encode(1, Varint::encode(1UL << 40, header)));
+    manyRows += std::string("\0\0", 2);
+    EXPECT_THROW(decoder.decode(manyRows.data(), manyRows.size()), ForColumnDecoder::Malformed);
+    std::string manyColumns(header, Varint::encode(1UL << 40, Varint::encode(5, header)));
+    manyColumns += std::string(10, '\0');
+    EXPECT_THROW(decoder.decode(manyColumns.data(), manyColumns.size()), ForColumnDecoder::Malformed);
+    std::string wide(header, Varint::encode(1, Varint::encode(1000, header)));
+    wide += std::string("\0\x08", 2) + std::string(100, '\0');
+    EXPECT_THROW(decoder.decode(wide.data(), wide.size()), ForColumnDecoder::Truncated);
+    wide[wide.size() - 101] = char(65);
+    EXPECT_THROW(decoder.decode(wide.data(), wide.size()), ForColumnDecoder::Malformed);
+
+    ForColumnEncoder extremes(1);
+    const long range[2] = { std::numeric_limits<long>::min(), std::numeric_limits<long>::max() };
+    extremes.addRow(&range[0]);
+    extremes.addRow(&range[1]);
+    output.str("");
+    extremes.writeTo(output);
+    bytes = output.str();
+    decoder.decode(bytes.data(), bytes.size());
+    EXPECT_EQ(range[0], decoder.columns()[0][0]);
+    EXPECT_EQ(range[1], decoder.columns()[0][1]);
+}
+
+// a session's queue, source and tree, built together on its home worker
+struct PoolSession
+{
+    PoolSession(long value)
+    :fromQueue(&dataQueue), tree(2), builder(std::this_thread::get_id())
+    {
+      dataQueue.push(DataQueue::value_type(value));
+      tree.addField(new FieldValueFromInput(fromQueue));
+    }
+
+    DataQueue dataQueue;
+    FromQueue fromQueue;
+    MultiFieldValue<DataQueue::value_type> tree;
+    std::thread::id builder;
+};
+
+TEST(FieldValueTest, SerializerPool)
+{
+    const size_t numSessions = 10;
+    std::vector<std::string> received(numSessions);
+    std::vector<boost::shared_ptr<PoolSession> > state(numSessions);
+    std::mutex receivedMutex;
+    size_t failing = numSessions;
+    SerializerPool<DataQueue::value_type> pool(3,
+      [&](size_t session, std::string const& records)
+      {
+        if(session == failing)
+          throw std::runtime_error("sink failed");
+        std::lock_guard<std::mutex> lock(receivedMutex);
+        received[session] += records;
+      });
+    ASSERT_EQ(3u, pool.workerCount());
+
+    for(size_t s=0; s<numSessions; ++s)
+    {
+      size_t id = pool.addSession([&state, s]()
+      {
+        state[s].reset(new PoolSession(long(s)));
+        // the tree shares ownership of the queue and source it reads
+        return SerializerPool<DataQueue::value_type>::Tree_ptr(state[s], &state[s]->tree);
+      });
+      EXPECT_EQ(s, id);
+      EXPECT_EQ(s % 3, pool.homeWorker(s));
+      EXPECT_NE(std::this_thread::get_id(), state[s]->builder);
+    }
+    EXPECT_EQ(state[0]->builder, state[3]->builder);
+    EXPECT_NE(state[0]->builder, state[1]->builder);
+    EXPECT_THROW(pool.addSession([]() { return SerializerPool<DataQueue::value_type>::Tree_ptr(); }),
+                 SerializerPool<DataQueue::value_type>::BuildFailed);
+    EXPECT_EQ(numSessions, pool.sessionCount());
+
+    pool.runBatch(3);
+    EXPECT_LE(pool.stolenSessions(), numSessions);
+    EXPECT_EQ("(0,7)(1,7)(0,7)(1,7)(0,7)(1,7)", received[7]);
+
+    state[7]->dataQueue.push(DataQueue::value_type(long(70)));
+    pool.runBatch(1);
+    EXPECT_EQ("(0,7)(1,7)(0,7)(1,7)(0,7)(1,7)(0,70)(1,70)", received[7]);
+    EXPECT_EQ("(0,2)(1,2)(0,2)(1,2)(0,2)(1,2)(0,2)(1,2)", received[2]);
+
+    // a failing session does not stop the others, the batch rethrows
+    failing = 4;
+    EXPECT_THROW(pool.runBatch(1), std::runtime_error);
+    EXPECT_EQ(10u * 5, received[2].size());
+    EXPECT_EQ(8u * 5, received[4].size());
+    failing = numSessions;
+    pool.runBatch(1);
+    EXPECT_EQ(10u * 5, received[4].size());
+}
+
+#ifdef __cpp_impl_coroutine
+// builds a record whenever the queue got new data
+RecordTask serializeOnPush(AwaitingFromQueue& source, FieldValueBase<DataQueue::value_type>& tree,
+                           std::ostream& output)
+{
+    for(;;)
+    {
+      co_await source.nextPush();
+      tree.update();
+      tree.serializeTo(output);
+    }
+}
+
+TEST(FieldValueTest, AwaitingFromQueue)
+{
+    const size_t numSessions = 100;
+    RecordExecutor executor;
+    DataQueue dataQueue[numSessions];
+    std::vector<boost::shared_ptr<AwaitingFromQueue> > sources;
+    std::vector<boost::shared_ptr<MultiFieldValue<DataQueue::value_type> > > trees;
+    std::vector<boost::shared_ptr<std::ostringstream> > outputs;
+    std::vector<RecordTask> builds;
+    for(size_t s=0; s<numSessions; ++s)
+    {
+      sources.push_back(boost::shared_ptr<AwaitingFromQueue>(new AwaitingFromQueue(&dataQueue[s], executor)));
+      trees.push_back(boost::shared_ptr<MultiFieldValue<DataQueue::value_type> >(
+        new MultiFieldValue<DataQueue::value_type>(1)));
+      trees[s]->addField(new FieldValue<AwaitingFromQueue>(*sources[s]));
+      outputs.push_back(boost::shared_ptr<std::ostringstream>(new std::ostringstream));
+      builds.push_back(serializeOnPush(*sources[s], *trees[s], *outputs[s]));
+    }
+
+    // nothing pushed yet: every build waits instead of serializing
+    EXPECT_EQ(0u, executor.pending());
+    EXPECT_EQ(0u, executor.runReady());
+    EXPECT_EQ("", outputs[0]->str());
+    EXPECT_FALSE(builds[0].done());
+
+    // a burst of pushes resumes the build once, with the latest value
+    dataQueue[3].push(DataQueue::value_type(long(1)));
+    dataQueue[3].push(DataQueue::value_type(long(2)));
+    EXPECT_EQ(1u, executor.pending());
+    EXPECT_EQ("", outputs[3]->str());
+    EXPECT_EQ(1u, executor.runReady());
+    EXPECT_EQ("(0,2)", outputs[3]->str());
+
+    for(size_t s=0; s<numSessions; s+=2)
+      dataQueue[s].push(DataQueue::value_type(long(s)));
+    EXPECT_EQ(numSessions/2, executor.runReady());
+    EXPECT_EQ("(0,42)", outputs[42]->str());
+    EXPECT_EQ("", outputs[43]->str());
+    EXPECT_EQ("(0,2)", outputs[3]->str());
+
+    // a push the build has not taken yet completes the next await at once
+    dataQueue[5].push(DataQueue::value_type(long(7)));
+    dataQueue[5].removeListener(sources[5].get());
+    dataQueue[5].push(DataQueue::value_type(long(8)));
+    EXPECT_EQ(1u, executor.runReady());
+    EXPECT_EQ("(0,8)", outputs[5]->str());
+    EXPECT_TRUE(sources[5]->hasNewValue() == false);
+
+    // a second source on a queue leaves the first one registered
+    {
+      AwaitingFromQueue second(&dataQueue[9], executor);
+      EXPECT_EQ(2u, dataQueue[9].listenerCount());
+    }
+    EXPECT_EQ(1u, dataQueue[9].listenerCount());
+    dataQueue[9].push(DataQueue::value_type(long(9)));
+    EXPECT_EQ(1u, executor.runReady());
+    EXPECT_EQ("(0,9)", outputs[9]->str());
+
+    // a destroyed build is withdrawn while waiting and once scheduled
+    DataQueue idleQueue;
+    AwaitingFromQueue idleSource(&idleQueue, executor);
+    MultiFieldValue<DataQueue::value_type> idleTree(1);
+    idleTree.addField(new FieldValue<AwaitingFromQueue>(idleSource));
+    std::ostringstream idleOutput;
+    {
+      RecordTask idle = serializeOnPush(idleSource, idleTree, idleOutput);
+    }
+    idleQueue.push(DataQueue::value_type(long(1)));
+    EXPECT_EQ(0u, executor.pending());
+    EXPECT_EQ(0u, executor.runReady());
+    {
+      RecordTask idle = serializeOnPush(idleSource, idleTree, idleOutput);
+      EXPECT_EQ("(0,1)", idleOutput.str());
+      idleQueue.push(DataQueue::value_type(long(2)));
+      dataQueue[1].push(DataQueue::value_type(long(3)));
+      EXPECT_EQ(2u, executor.pending());
+    }
+    EXPECT_EQ(1u, executor.pending());
+    EXPECT_EQ(1u, executor.runReady());
+    EXPECT_EQ("(0,1)", idleOutput.str());
+    EXPECT_EQ("(0,3)", outputs[1]->str());
+}
+#endif
+
+#ifdef __linux__
+TEST(FieldValueTest, QueueNotifier)
+{
+    DataQueue       dataQueue[3];
+    std::vector<FromQueue> fromQueue;
+    for(size_t i=0; i<3; ++i)
+      fromQueue.push_back(FromQueue(&dataQueue[i]));
+
+    // two trees, the first reading two queues
+    MultiFieldValue<DataQueue::value_type> first(1);
+    first.addField(new FieldValueFromInput(fromQueue[0]));
+    first.addField(new FieldValueFromInput(fromQueue[1]));
+    MultiFieldValue<DataQueue::value_type> second(1);
+    second.addField(new FieldValueFromInput(fromQueue[2]));
+
+    QueueNotifier firstReady;
+    firstReady.watch(dataQueue[0]);
+    firstReady.watch(dataQueue[1]);
+    QueueNotifier secondReady;
+    secondReady.watch(dataQueue[2]);
+
+    std::ostringstream output;
+    EpollLoop loop;
+    loop.add(firstReady, [&]() { first.update(); first.serializeTo(output); });
+    loop.add(secondReady, [&]() { second.update(); second.serializeTo(output); });
+    EXPECT_EQ(0u, loop.runOnce(0));
+
+    // a burst over both queues of the first tree wakes the loop once
+    dataQueue[0].push(DataQueue::value_type(long(1)));
+    dataQueue[1].push(DataQueue::value_type(long(2)));
+    dataQueue[0].push(DataQueue::value_type(long(3)));
+    EXPECT_EQ(1u, firstReady.notifications());
+    EXPECT_EQ(1u, loop.runOnce(0));
+    EXPECT_EQ("(0,3)(0,2)", output.str());
+    EXPECT_EQ(0u, loop.runOnce(0));
+
+    output.str("");
+    dataQueue[2].push(DataQueue::value_type(long(4)));
+    dataQueue[1].push(DataQueue::value_type(long(5)));
+    EXPECT_EQ(2u, loop.runOnce(-1));
+    EXPECT_EQ(2u, firstReady.notifications());
+    EXPECT_EQ(1u, secondReady.notifications());
+    // "(0,3)(0,5)" and "(0,4)" in either order
+    EXPECT_EQ(15u, output.str().size());
+    EXPECT_FALSE(secondReady.drain());
+
+    // a second notifier on a queue does not take it from the first
+    {
+      QueueNotifier alsoReady;
+      alsoReady.watch(dataQueue[2]);
+      EXPECT_EQ(2u, dataQueue[2].listenerCount());
+      dataQueue[2].push(DataQueue::value_type(long(6)));
+      EXPECT_TRUE(alsoReady.drain());
+      EXPECT_EQ(2u, secondReady.notifications());
+    }
+    EXPECT_EQ(1u, dataQueue[2].listenerCount());
+    dataQueue[2].push(DataQueue::value_type(long(7)));
+    EXPECT_EQ(1u, loop.runOnce(0));
+}
+#endif
+
+TEST(FieldValueTest, LatencyHistogram)
+{
+    LatencyHistogram histogram;
+    EXPECT_EQ(0u, histogram.percentile(50));
+    for(unsigned long long v=0; v<16; ++v)
+      EXPECT_EQ(v, LatencyHistogram::highestOf(LatencyHistogram::bucketOf(v)));
+    EXPECT_EQ(33u, LatencyHistogram::highestOf(LatencyHistogram::bucketOf(32)));
+    EXPECT_EQ(1023u + 64, LatencyHistogram::highestOf(LatencyHistogram::bucketOf(1024 + 63)));
+    EXPECT_GT(size_t(LatencyHistogram::NumBuckets), LatencyHistogram::bucketOf(~0ULL));
+
+    for(unsigned long long v=1; v<=1000; ++v)
+      histogram.record(v);
+    EXPECT_EQ(1000u, histogram.count());
+    EXPECT_EQ(1000u, histogram.max());
+    // within one sub-bucket, 1/16, above the exact percentile
+    EXPECT_LE(500u, histogram.percentile(50));
+    EXPECT_GE(500u + 500/16, histogram.percentile(50));
+    EXPECT_LE(990u, histogram.percentile(99));
+    EXPECT_EQ(1000u, histogram.percentile(100));
+
+    // end to end, every push counts once, also one repeating the value
+    DataQueue       dataQueue[2];
+    std::vector<FromQueue> fromQueue;
+    for(size_t i=0; i<2; ++i)
+    {
+      dataQueue[i].setTimestamping(true);
+      fromQueue.push_back(FromQueue(&dataQueue[i]));
+    }
+    MultiFieldValue<DataQueue::value_type> multi(3);
+    multi.addField(new FieldValueFromInput(fromQueue[0]));
+    multi.addField(new FieldValueFromInput(fromQueue[1]));
+    LatencyHistogram latencies;
+    multi.setLatencyHistogram(&latencies);
+
+    dataQueue[0].push(DataQueue::value_type(long(1)));
+    dataQueue[1].push(DataQueue::value_type(long(2)));
+    EXPECT_NE(0u, dataQueue[0].pushTimestamp());
+    LatencyClock::Ticks before = LatencyClock::now();
+    multi.update();
+    std::ostringstream output;
+    multi.serializeTo(output);
+    EXPECT_EQ(2u, latencies.count());
+    EXPECT_LE(before - dataQueue[1].pushTimestamp(), latencies.max());
+
+    multi.update();
+    multi.serializeTo(output);
+    EXPECT_EQ(2u, latencies.count());
+    dataQueue[0].push(DataQueue::value_type(long(1)));
+    multi.update();
+    multi.serializeTo(output);
+    EXPECT_EQ(3u, latencies.count());
+    dataQueue[0].push(DataQueue::value_type(long(1)));
+    multi.update();
+    multi.serializeTo(output);
+    EXPECT_EQ(4u, latencies.count());
+
+    dataQueue[1].push(DataQueue::value_type(long(3)));
+    multi.update();
+    multi.serializeTo(output);
+    EXPECT_EQ(5u, latencies.count());
+
+    output.str("");
+    latencies.reportTo(output, LatencyClock::nanosPerTick());
+    EXPECT_EQ(0u, output.str().find("count 5 p50 "));
+    EXPECT_NE(std::string::npos, output.str().find(" p99.9 "));
+}
+
+TEST(FieldValueTest, SchemaLoader)
+{
+    DataQueue       bid, ask, flags;
+    bid.push(DataQueue::value_type(long(100)));
+    ask.push(DataQueue::value_type(long(300)));
+    flags.push(DataQueue::value_type(long(5)));
+    SchemaLoader loader;
+    loader.bindQueue("bid", &bid);
+    loader.bindQueue("ask", &ask);
+    loader.bindQueue("flags", &flags);
+
+    SchemaLoader::FieldValueBase_ptr quote = loader.load(
+      "# one quote, twice\n"
+      "multi 2 {\n"
+      "  field bid\n"
+      "  field ask varint   # as LEB128\n"
+      "  const 7 const 2.5\n"
+      "  multi 2 { field bid }\n"
+      "}\n");
+    quote->update();
+    std::ostringstream output;
+    quote->serializeTo(output);
+    EXPECT_EQ("(0,100)\xac\x02(0,7)(0,2.5)(0,100)(1,100)\xac\x02(1,7)(1,2.5)(1,100)", output.str());
+
+    SchemaLoader::FieldValueBase_ptr bits = loader.load("bits 1 { 3 field flags 2 const 1 3 const -1 }");
+    bits->update();
+    output.str("");
+    bits->serializeTo(output);
+    EXPECT_EQ("11101101", output.str());
+
+    // the arena stays with the root, not with the loader
+    SchemaLoader::FieldValueBase_ptr kept = SchemaLoader().build(SchemaParser::parse("const 3"));
+    kept->update();
+    output.str("");
+    kept->serializeTo(output);
+    EXPECT_EQ("3", output.str());
+
+    EXPECT_THROW(loader.load("field nowhere"), SchemaError);
+    EXPECT_THROW(loader.load("multi 0 { }"), SchemaError);
+    EXPECT_THROW(loader.load("multi 1 { field bid"), SchemaError);
+    EXPECT_THROW(loader.load("field bid field ask"), SchemaError);
+    EXPECT_THROW(loader.load("bits 1 { 4 multi 1 { } }"), SchemaError);
+    try
+    {
+      loader.load("bits 1 {\n 5 field bid\n 4 field ask\n}");
+      FAIL();
+    }
+    catch(SchemaError const& error)
+    {
+      EXPECT_EQ(3u, error.line());
+    }
+}
+
+TEST(FieldValueTest, CacheLineLayout)
+{
+    DataQueue       bid, ask, flags;
+    bid.push(DataQueue::value_type(long(100)));
+    ask.push(DataQueue::value_type(long(300)));
+    flags.push(DataQueue::value_type(long(5)));
+    SchemaLoader loader;
+    loader.bindQueue("bid", &bid);
+    loader.bindQueue("ask", &ask);
+    loader.bindQueue("flags", &flags);
+    SchemaDescription schema = SchemaParser::parse(
+      "multi 2 {\n"
+      "  field bid\n"
+      "  multi 2 { field ask varint multi 1 { const 4 } }\n"
+      "  bits 1 { 3 field flags 2 const 1 }\n"
+      "  tlv bid\n"
+      "  const 2.5\n"
+      "}\n");
+
+    SchemaLoader::FieldValueBase_ptr preorder = loader.build(schema);
+    loader.setNodeLayout(CacheLineLayout);
+    SchemaLoader::FieldValueBase_ptr siblingsFirst = loader.build(schema);
+    EXPECT_EQ(0u, reinterpret_cast<size_t>(siblingsFirst.get()) % NodeArena::CacheLineSize);
+
+    for(int round=0; round<3; ++round)
+    {
+      if(round == 2)
+      {
+        ask.push(DataQueue::value_type(long(-2)));
+        flags.push(DataQueue::value_type(long(2)));
+      }
+      preorder->update();
+      siblingsFirst->update();
+      std::ostringstream expected, output;
+      preorder->serializeTo(expected);
+      siblingsFirst->serializeTo(output);
+      EXPECT_EQ(expected.str(), output.str());
+    }
+
+    EXPECT_THROW(loader.load("multi 1 { multi 1 { field bid }"), SchemaError);
+    EXPECT_THROW(loader.load("multi 1 { field bid } field ask"), SchemaError);
+}
+
+TEST(FieldValueTest, SchemaImage)
+{
+    DataQueue       bid, ask;
+    bid.push(DataQueue::value_type(long(100)));
+    ask.push(DataQueue::value_type(long(300)));
+    SchemaLoader loader;
+    loader.bindQueue("bid", &bid);
+    loader.bindQueue("ask", &ask);
+
+    SchemaDescription schema = SchemaParser::parse(
+      "multi 2 { field bid tlv ask const -4 bits 1 { 3 field bid 5 const 2 } }");
+    std::string path = std::string(get_test_info()->name()) + ".bin";
+    SchemaImage::save(schema, path);
+
+    std::ostringstream fromText;
+    SchemaLoader::FieldValueBase_ptr tree = loader.build(schema);
+    tree->update();
+    tree->serializeTo(fromText);
+
+    SchemaLoader::FieldValueBase_ptr mapped;
+    {
+      SchemaImage image(path);
+      EXPECT_EQ(schema.nodes.size(), image.nodeCount());
+      EXPECT_EQ(std::string("bidaskbid"), std::string(image.names(), image.namesSize()));
+      mapped = loader.build(image);
+    }
+    // the tree does not refer to the image once built
+    std::ostringstream fromImage;
+    mapped->update();
+    mapped->serializeTo(fromImage);
+    EXPECT_EQ(fromText.str(), fromImage.str());
+
+    std::string bytes;
+    {
+      std::ifstream input(path.c_str(), std::ios::binary);
+      bytes.assign(std::istreambuf_iterator<char>(input), std::istreambuf_iterator<char>());
+    }
+    std::ofstream(path.c_str(), std::ios::binary).write(bytes.data(), bytes.size()-1);
+    EXPECT_THROW(SchemaImage image(path), SchemaError);
+    bytes[0] = 'X';
+    std::ofstream(path.c_str(), std::ios::binary).write(bytes.data(), bytes.size());
+    EXPECT_THROW(SchemaImage image(path), SchemaError);
+
+    // the nodes are checked like the parser checks the text
+    EXPECT_EQ(0, SchemaValidator::findProblem(&schema.nodes[0], schema.nodes.size(), schema.names.size()));
+    for(int corruption=0; corruption<7; ++corruption)
+    {
+      SchemaDescription corrupt = schema;
+      switch(corruption)
+      {
+      case 0: corrupt.nodes[1].encoding = 9; break;
+      case 1: corrupt.nodes[2].kind = 0; break;
+      case 2: corrupt.nodes[0].children = 5; break;
+      case 3: corrupt.nodes[2].nameOffset = 8; break;
+      case 4: corrupt.nodes[5].bits = 7; break;
+      case 5: corrupt.nodes[0].size = 0; break;
+      default: corrupt.nodes.push_back(schema.nodes[3]); break;
+      }
+      SchemaImage::save(corrupt, path);
+      EXPECT_THROW(SchemaImage image(path), SchemaError) << "corruption " << corruption;
+    }
+    std::remove(path.c_str());
+    EXPECT_THROW(SchemaImage image(path), SchemaError);
+}
+
+TEST(FieldValueTest, TreePublisher)
+{
+    typedef TreePublisher<DataQueue::value_type> Publisher;
+    FromDefault one(DataQueue::value_type(long(1)));
+    FromDefault two(DataQueue::value_type(long(2)));
+    boost::shared_ptr<MultiFieldValue<DataQueue::value_type> > first(new MultiFieldValue<DataQueue::value_type>(1));
+    first->addField(new FieldValueDefault(one));
+    first->update();
+
+    Publisher publisher(first);
+    boost::weak_ptr<MultiFieldValue<DataQueue::value_type> > firstAlive(first);
+    first.reset();
+    Publisher::Reader& reader = publisher.registerReader();
+    Publisher::Reader& idle = publisher.registerReader();
+
+    std::ostringstream output;
+    {
+      Publisher::Section section(publisher, reader);
+      section->serializeTo(output);
+
+      // adding a field: build a new tree and swap it in under the reader
+      boost::shared_ptr<MultiFieldValue<DataQueue::value_type> > second(new MultiFieldValue<DataQueue::value_type>(1));
+      second->addField(new FieldValueDefault(one));
+      second->addField(new FieldValueDefault(two));
+      second->update();
+      publisher.publish(second);
+      EXPECT_EQ(1u, publisher.reclaim());
+      EXPECT_FALSE(firstAlive.expired());
+      section->serializeTo(output);
+    }
+    EXPECT_EQ("(0,1)(0,1)", output.str());
+    EXPECT_EQ(0u, publisher.reclaim());
+    EXPECT_TRUE(firstAlive.expired());
+
+    output.str("");
+    {
+      Publisher::Section section(publisher, reader);
+      section->serializeTo(output);
+    }
+    EXPECT_EQ("(0,1)(0,2)", output.str());
+    (void)idle;
+
+    // readers on other threads keep going while roots are swapped
+    std::atomic<bool> stop(false);
+    std::atomic<unsigned long> reads(0);
+    std::vector<std::thread> threads;
+    for(size_t t=0; t<3; ++t)
+    {
+      Publisher::Reader& threadReader = publisher.registerReader();
+      threads.push_back(std::thread([&, t]()
+      {
+        while(!stop)
+        {
+          Publisher::Section section(publisher, threadReader);
+          section->changeVersion();
+          ++reads;
+        }
+      }));
+    }
+    for(long i=0; i<200 || reads < 1000; ++i)
+    {
+      boost::shared_ptr<MultiFieldValue<DataQueue::value_type> > next(new MultiFieldValue<DataQueue::value_type>(1));
+      next->addField(new FieldValueDefault(one));
+      next->update();
+      publisher.publish(next);
+      publisher.reclaim();
+    }
+    stop = true;
+    for(size_t t=0; t<threads.size(); ++t)
+      threads[t].join();
+    EXPECT_EQ(0u, publisher.reclaim());
+    EXPECT_LT(0u, reads.load());
+}
+
+// the size query against the bytes actually written
+template<typename ValueType>
+::testing::AssertionResult SizeMatches(FieldValueBase<ValueType>& tree, bool exact = true)
+{
+  size_t expected = tree.serializedSize();
+  std::ostringstream output;
+  tree.serializeTo(output);
+  size_t actual = output.str().size();
+  if(exact ? expected == actual : expected >= actual)
+    return ::testing::AssertionSuccess();
+  return ::testing::AssertionFailure(::testing::Message()
+    << "serializedSize() " << expected << ", serializeTo() wrote " << actual);
+}
+
+TEST(FieldValueTest, SerializedSize)
+{
+    DataQueue       dataQueue[4];
+    std::vector<FromQueue> fromQueue;
+    for(size_t i=0; i<4; ++i)
+      fromQueue.push_back(FromQueue(&dataQueue[i]));
+    dataQueue[0].push(DataQueue::value_type(long(-12345)));
+    dataQueue[1].push(DataQueue::value_type(std::string("text")));
+    BaseItemIDList list;
+    list.push_back(BaseItemID(7, BaseItem(long(70))));
+    list.push_back(BaseItemID(-8, BaseItem(std::string("eight"))));
+    dataQueue[2].push(DataQueue::value_type(list));
+    dataQueue[3].push(DataQueue::value_type(long(300)));
+
+    FromDefault constant(DataQueue::value_type(long(42)));
+    boost::shared_ptr<MultiFieldValue<DataQueue::value_type> > inner(new MultiFieldValue<DataQueue::value_type>(12));
+    inner->addField(new FieldValueFromInput(fromQueue[3]));
+    MultiFieldValue<DataQueue::value_type> multi(12);
+    for(size_t i=0; i<3; ++i)
+      multi.addField(new FieldValueFromInput(fromQueue[i]));
+    multi.addField(new TlvFieldValueFromInput(fromQueue[2]));
+    multi.addField(new FieldValueDefault(constant));
+    multi.addField(inner);
+    multi.update();
+    EXPECT_TRUE(SizeMatches(multi));
+    // from the cache now
+    EXPECT_TRUE(SizeMatches(multi));
+    std::ostringstream nth;
+    multi.serializeNthValueTo(11, nth);
+    EXPECT_EQ(nth.str().size(), multi.serializedNthSize(11));
+
+    dataQueue[0].push(DataQueue::value_type(long(9)));
+    multi.update();
+    EXPECT_TRUE(SizeMatches(multi));
+
+    multi.foldConstants();
+    multi.setEncoding(ZigZagEncoding);
+    inner->setEncoding(FixedEncoding);
+    dataQueue[1].push(DataQueue::value_type(long(-1000)));
+    dataQueue[2].push(DataQueue::value_type(long(5)));
+    multi.update();
+    EXPECT_TRUE(SizeMatches(multi));
+
+    // doubles in text are bounded
+    dataQueue[0].push(DataQueue::value_type(0.1));
+    multi.setEncoding(TextEncoding);
+    dataQueue[1].push(DataQueue::value_type(long(3)));
+    dataQueue[2].push(DataQueue::value_type(long(4)));
+    multi.update();
+    EXPECT_TRUE(SizeMatches(multi, false));
+
+    BitSetValue<DataQueue::value_type> bits(2);
+    bits.addBits(3, new FieldValueFromInput(fromQueue[3]));
+    bits.addBits(9, new FieldValueDefault(constant));
+    bits.update();
+    EXPECT_TRUE(SizeMatches(bits));
+}
+
+TEST(FieldValueTest, ParallelRepetitions)
+{
+    DataQueue       dataQueue[3];
+    std::vector<FromQueue> fromQueue;
+    for(size_t i=0; i<3; ++i)
+    {
+      dataQueue[i].push(DataQueue::value_type(long(i)));
+      fromQueue.push_back(FromQueue(&dataQueue[i]));
+    }
+    FromDefault constant(DataQueue::value_type(long(42)));
+
+    TaskPool pool(3);
+    const size_t numRepeat = 1000;
+    MultiFieldValue<DataQueue::value_type> serial(numRepeat);
+    MultiFieldValue<DataQueue::value_type> parallel(numRepeat);
+    parallel.setParallel(&pool, 100);
+    MultiFieldValue<DataQueue::value_type>* trees[2] = { &serial, &parallel };
+    for(size_t t=0; t<2; ++t)
+    {
+      for(size_t i=0; i<3; ++i)
+        trees[t]->addField(new FieldValueFromInput(fromQueue[i]));
+      trees[t]->addField(new FieldValueDefault(constant));
+    }
+
+    std::ostringstream serialOutput, parallelOutput;
+    for(long round=0; round<7; ++round)
+    {
+      // all fields, then one field, then none change
+      if(round == 1)
+        dataQueue[1].push(DataQueue::value_type(long(-123456)));
+      if(round == 2)
+        dataQueue[2].push(DataQueue::value_type(std::string("text")));
+      if(round == 3)
+        parallel.foldConstants();
+      // the folded constant is refolded before the tasks run
+      if(round == 4)
+        constant.setValue(DataQueue::value_type(long(43)));
+      // doubles are sized as an upper bound, lazy fields pulled up front
+      if(round == 5)
+        dataQueue[0].push(DataQueue::value_type(0.5));
+      if(round == 6)
+      {
+        serial.setUpdateMode(LazyUpdate);
+        parallel.setUpdateMode(LazyUpdate);
+        dataQueue[1].push(DataQueue::value_type(long(7)));
+      }
+      serial.update();
+      parallel.update();
+      serialOutput.str("");
+      parallelOutput.str("");
+      serial.serializeTo(serialOutput);
+      parallel.serializeTo(parallelOutput);
+      EXPECT_EQ(serialOutput.str(), parallelOutput.str());
+      if(round < 3)
+      {
+        EXPECT_EQ(serial.dirtyFields().count(), parallel.dirtyFields().count());
+      }
+    }
+    std::ostringstream nth;
+    parallel.serializeNthValueTo(777, nth);
+    EXPECT_EQ("(777,0.5)(777,7)(777,text)(777,43)", nth.str());
+
+    // a nested multi is not reentrant, its tree is encoded serially
+    boost::shared_ptr<MultiFieldValue<DataQueue::value_type> > inner(new MultiFieldValue<DataQueue::value_type>(numRepeat));
+    inner->addField(new FieldValueFromInput(fromQueue[0]));
+    MultiFieldValue<DataQueue::value_type> outer(numRepeat);
+    outer.setParallel(&pool, 1);
+    outer.addField(inner);
+    outer.update();
+    std::ostringstream outerOutput;
+    outer.serializeTo(outerOutput);
+    EXPECT_EQ(10u*7 + 90*8 + 900*9, outerOutput.str().size());
+    EXPECT_EQ(0u, outerOutput.str().find("(0,0.5)(1,0.5)(2,0.5)"));
+}
+
+TEST(FieldValueTest, Crc32c)
+{
+    // the check value of the CRC-32C catalogue entry
+    EXPECT_EQ(0xe3069283u, Crc32c::compute("123456789", 9));
+    std::string data;
+    for(int i=0; i<1000; ++i)
+      data.push_back(char(i * 7919));
+    boost::uint32_t crc = Crc32c::updateSoftware(0, data.data(), data.size());
+    EXPECT_EQ(crc, Crc32c::compute(data.data(), data.size()));
+    EXPECT_EQ(crc, Crc32c::update(Crc32c::update(0, data.data(), 333), data.data()+333, 667));
+
+    DataQueue       dataQueue[2];
+    std::vector<FromQueue> fromQueue;
+    for(size_t i=0; i<2; ++i)
+    {
+      dataQueue[i].push(DataQueue::value_type(long(i+1)));
+      fromQueue.push_back(FromQueue(&dataQueue[i]));
+    }
+    MultiFieldValue<DataQueue::value_type>* multi = new MultiFieldValue<DataQueue::value_type>(2);
+    multi->addField(new FieldValueFromInput(fromQueue[0]));
+    multi->addField(new FieldValueFromInput(fromQueue[1]));
+    ChecksumValue<DataQueue::value_type> record(multi);
+    EXPECT_EQ(multi->serializedSize() + 4, record.serializedSize());
+
+    for(int round=0; round<3; ++round)
+    {
+      if(round == 2)
+        dataQueue[1].push(DataQueue::value_type(long(-5)));
+      record.update();
+      std::ostringstream output;
+      record.serializeTo(output);
+      std::string bytes = output.str();
+      std::string body = round < 2 ? "(0,1)(0,2)(1,1)(1,2)" : "(0,1)(0,-5)(1,1)(1,-5)";
+      ASSERT_EQ(body.size() + 4, bytes.size());
+      EXPECT_EQ(body, bytes.substr(0, body.size()));
+      crc = Crc32c::compute(body.data(), body.size());
+      EXPECT_EQ(crc, record.checksum());
+      std::string trailer(bytes, body.size());
+      for(int i=0; i<4; ++i)
+        EXPECT_EQ(char(crc >> (8*i)), trailer[i]);
+    }
+
+    std::ostringstream nth;
+    record.serializeNthValueTo(1, nth);
+    EXPECT_EQ(Crc32c::compute("(1,1)(1,-5)", 11), record.checksum());
+    EXPECT_EQ(11u + 4, nth.str().size());
+}
+
+TEST(FieldValueTest, BlockCompression)
+{
+    std::vector<std::string> blocks;
+    blocks.push_back("");
+    blocks.push_back("abc");
+    blocks.push_back(std::string(1000, 'a'));
+    std::string mixed;
+    unsigned long seed = 1;
+    for(size_t i=0; i<20000; ++i)
+    {
+      seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+      mixed.push_back(i % 3000 < 1500 ? char(seed >> 56) : char('0' + i % 7));
+    }
+    blocks.push_back(mixed);
+    Lz4Block::HashTable table;
+    for(size_t b=0; b<blocks.size(); ++b)
+    {
+      std::string const& raw = blocks[b];
+      std::vector<char> compressed(Lz4Block::compressBound(raw.size()));
+      size_t size = Lz4Block::compress(raw.data(), raw.size(), &compressed[0], table);
+      EXPECT_LE(size, compressed.size());
+      std::string restored(raw.size(), ' ');
+      EXPECT_EQ(raw.size(), Lz4Block::decompress(&compressed[0], size, &restored[0], restored.size()));
+      EXPECT_EQ(raw, restored);
+      if(raw.size() == 1000)
+      {
+        EXPECT_GT(20u, size);
+        EXPECT_THROW(Lz4Block::decompress(&compressed[0], size, &restored[0], 999), Lz4Block::Malformed);
+        EXPECT_THROW(Lz4Block::decompress(&compressed[0], 3, &restored[0], 1000), Lz4Block::Malformed);
+      }
+    }
+
+    // delta records through the compressing stream and back to the decoder
+    DataQueue       dataQueue[3];
+    std::vector<FromQueue> fromQueue;
+    for(size_t i=0; i<3; ++i)
+    {
+      dataQueue[i].push(DataQueue::value_type(long(i)));
+      fromQueue.push_back(FromQueue(&dataQueue[i]));
+    }
+    MultiFieldValue<DataQueue::value_type> multi(2);
+    for(size_t i=0; i<3; ++i)
+      multi.addField(new FieldValueFromInput(fromQueue[i]));
+
+    std::ostringstream plain;
+    std::ostringstream packed;
+    CompressingStreamBuf compressBuf(packed.rdbuf(), 256);
+    std::ostream compressOutput(&compressBuf);
+    for(long r=0; r<500; ++r)
+    {
+      dataQueue[r % 3].push(DataQueue::value_type(r % 5));
+      multi.update();
+      std::ostringstream record;
+      multi.serializeDeltaTo(record);
+      plain << record.str();
+      compressOutput << record.str();
+      if(r % 100 == 99)
+        compressOutput.flush();
+    }
+    EXPECT_EQ(plain.str().size(), compressBuf.rawSize());
+    EXPECT_EQ(packed.str().size(), compressBuf.storedSize());
+    EXPECT_GT(plain.str().size() / 2, packed.str().size());
+
+    std::string bytes = packed.str();
+    std::string records;
+    BlockDecompressor decompressor(256);
+    EXPECT_EQ(0u, decompressor.decodeBlock(bytes.data(), 2, records));
+    EXPECT_EQ(bytes.size(), decompressor.decode(bytes.data(), bytes.size(), records));
+    EXPECT_EQ(plain.str(), records);
+
+    DeltaDecoder decoder(multi.deltaFieldBits());
+    for(size_t used=0; used<records.size(); )
+      used += decoder.decode(records.data()+used, records.size()-used);
+    EXPECT_EQ(499 % 5, decoder.values()[499 % 3]);
+    EXPECT_EQ(498 % 5, decoder.values()[498 % 3]);
+
+    // a block that does not come out at its raw size
+    std::string ones(1000, '1');
+    std::vector<char> compressed(Lz4Block::compressBound(ones.size()));
+    size_t size = Lz4Block::compress(ones.data(), ones.size(), &compressed[0], table);
+    char header[2*Varint::MaxBytes];
+    std::string corrupt(header, Varint::encode(size, Varint::encode(1001, header)));
+    corrupt.append(&compressed[0], size);
+    records.clear();
+    EXPECT_THROW(BlockDecompressor(1024).decode(corrupt.data(), corrupt.size(), records), BlockDecompressor::Malformed);
+    EXPECT_TRUE(records.empty());
+
+    // raw sizes above the block size are rejected before anything is allocated
+    std::string huge(header, Varint::encode(1, Varint::encode(~0UL >> 1, header)));
+    EXPECT_THROW(decompressor.decodeBlock(huge.data(), huge.size(), records), BlockDecompressor::Malformed);
+    EXPECT_THROW(BlockDecompressor(999).decode(corrupt.data(), corrupt.size(), records), BlockDecompressor::Malformed);
+    EXPECT_TRUE(records.empty());
+
+    // without a target, or with one that is full, writes fail
+    {
+      CompressingStreamBuf unconnected(0, 256);
+      std::ostream unconnectedOutput(&unconnected);
+      unconnectedOutput << ones;
+      EXPECT_TRUE(unconnectedOutput.bad());
+      EXPECT_EQ(-1, unconnected.pubsync());
+    }
+    char room[16];
+    SpanBuf full;
+    full.setSpan(room, sizeof(room));
+    CompressingStreamBuf blocked(&full, 256);
+    std::ostream blockedOutput(&blocked);
+    blockedOutput << std::string(100, 'x') << plain.str().substr(0, 100);
+    blockedOutput.flush();
+    EXPECT_TRUE(blockedOutput.bad());
+    EXPECT_EQ(0u, blocked.rawSize());
+}
+
+TEST(FieldValueTest, GatherOutput)
+{
+    FromDefault title(DataQueue::value_type(std::string(100, 'h')));
+    FromDefault version(DataQueue::value_type(long(7)));
+    FieldValueDefault header(title);
+    FieldValueDefault small(version);
+    TlvFieldValue<FromDefault> tlv(version);
+    header.foldConstants();
+    small.foldConstants();
+    tlv.foldConstants();
+
+    DataQueue       dataQueue[2];
+    std::vector<FromQueue> fromQueue;
+    for(size_t i=0; i<2; ++i)
+    {
+      dataQueue[i].push(DataQueue::value_type(long(i+1)));
+      fromQueue.push_back(FromQueue(&dataQueue[i]));
+    }
+    MultiFieldValue<DataQueue::value_type> multi(20);
+    multi.addField(new FieldValueFromInput(fromQueue[0]));
+    multi.addField(new FieldValueFromInput(fromQueue[1]));
+    FieldValueBase<DataQueue::value_type>* record[] = { &header, &small, &tlv, &multi };
+
+    GatherOutput gather;
+    for(int round=0; round<2; ++round)
+    {
+      if(round == 1)
+      {
+        title.setValue(DataQueue::value_type(std::string(80, 't')));
+        dataQueue[1].push(DataQueue::value_type(long(-3)));
+      }
+      multi.update();
+      std::ostringstream expected;
+      gather.clear();
+      for(size_t n=0; n<4; ++n)
+      {
+        record[n]->serializeTo(expected);
+        record[n]->serializeSegmentsTo(gather);
+      }
+
+      // the title and the cache are referenced, the rest is copied
+      EXPECT_EQ(expected.str().size(), gather.size());
+      EXPECT_EQ(header.serializedSize() + multi.serializedSize(), gather.referencedBytes());
+      EXPECT_EQ(small.serializedSize() + tlv.serializedSize(), gather.copiedBytes());
+      ASSERT_EQ(3u, gather.iovecCount());
+      EXPECT_EQ(header.serializedSize(), gather.iovecs()[0].iov_len);
+      std::ostringstream copied;
+      gather.copyTo(copied);
+      EXPECT_EQ(expected.str(), copied.str());
+
+#ifdef GATHEROUTPUT_WRITEV
+      int fds[2];
+      ASSERT_EQ(0, pipe(fds));
+      gather.writeTo(fds[1]);
+      std::string written(gather.size() + 1, ' ');
+      EXPECT_EQ(ssize_t(gather.size()), read(fds[0], &written[0], written.size()));
+      written.resize(gather.size());
+      EXPECT_EQ(expected.str(), written);
+      close(fds[0]);
+      close(fds[1]);
+#endif
+    }
+
+    // folded strings go into repetitions whole
+    std::ostringstream nth;
+    header.serializeNthValueTo(3, nth);
+    EXPECT_EQ("(3," + std::string(80, 't') + ")", nth.str());
+}
+
+TEST(FieldValueTest, GatherUnchangedSegments)
+{
+    DataQueue       dataQueue[3];
+    std::vector<FromQueue> fromQueue;
+    for(size_t i=0; i<3; ++i)
+    {
+      dataQueue[i].push(DataQueue::value_type(long(10*(i+1))));
+      fromQueue.push_back(FromQueue(&dataQueue[i]));
+    }
+    MultiFieldValue<DataQueue::value_type> multi(50);
+    for(size_t i=0; i<3; ++i)
+      multi.addField(new FieldValueFromInput(fromQueue[i]));
+
+    GatherOutput gather(1);
+    multi.update();
+    multi.serializeSegmentsTo(gather);
+    ASSERT_EQ(1u, gather.iovecCount());
+    const char* cached = static_cast<const char*>(gather.iovecs()[0].iov_base);
+    std::string before(cached, gather.size());
+
+    // the new value has as many digits, only its segments are rewritten
+    dataQueue[1].push(DataQueue::value_type(long(21)));
+    multi.update();
+    gather.clear();
+    multi.serializeSegmentsTo(gather);
+    ASSERT_EQ(1u, gather.iovecCount());
+    EXPECT_EQ(cached, gather.iovecs()[0].iov_base);
+    EXPECT_EQ(0u, gather.copiedBytes());
+    EXPECT_EQ(before.size(), gather.referencedBytes());
+    std::ostringstream expected;
+    for(size_t i=0; i<50; ++i)
+      expected << '(' << i << ",10)(" << i << ",21)(" << i << ",30)";
+    std::ostringstream copied;
+    gather.copyTo(copied);
+    EXPECT_EQ(expected.str(), copied.str());
+    EXPECT_EQ(1u, multi.dirtyFields().count());
+
+    // one more digit moves the segments after it
+    dataQueue[2].push(DataQueue::value_type(long(300)));
+    multi.update();
+    gather.clear();
+    multi.serializeSegmentsTo(gather);
+    EXPECT_EQ(before.size() + 50, gather.size());
+    expected.str("");
+    for(size_t i=0; i<50; ++i)
+      expected << '(' << i << ",10)(" << i << ",21)(" << i << ",300)";
+    copied.str("");
+    gather.copyTo(copied);
+    EXPECT_EQ(expected.str(), copied.str());
+}
+
+TEST(FieldValueTest, PrefetchDistance)
+{
+    DataQueue       dataQueue[5];
+    std::vector<FromQueue> fromQueue;
+    for(size_t i=0; i<5; ++i)
+    {
+      dataQueue[i].push(DataQueue::value_type(long(i)));
+      fromQueue.push_back(FromQueue(&dataQueue[i]));
+    }
+    FromDefault one(DataQueue::value_type(long(1)));
+
+    // the same bytes whatever the distance, also past the last field
+    const size_t distances[] = { 0, 1, 2, 3, 8 };
+    std::string expected;
+    for(size_t d=0; d<sizeof(distances)/sizeof(distances[0]); ++d)
+    {
+      MultiFieldValue<DataQueue::value_type> multi(2);
+      BitSetValue<DataQueue::value_type>* bitset = new BitSetValue<DataQueue::value_type>(2);
+      for(size_t i=0; i<5; ++i)
+      {
+        multi.addField(new FieldValueFromInput(fromQueue[i]));
+        bitset->addBits(3, new FieldValueFromInput(fromQueue[i]));
+      }
+      bitset->addBits(1, new FieldValueDefault(one));
+      multi.addField(bitset);
+      multi.foldConstants();
+      multi.setPrefetchDistance(distances[d]);
+
+      std::ostringstream output;
+      for(long round=0; round<3; ++round)
+      {
+        multi.update();
+        multi.serializeTo(output);
+        dataQueue[round].push(DataQueue::value_type(round + 5));
+      }
+      dataQueue[0].push(DataQueue::value_type(long(0)));
+      dataQueue[1].push(DataQueue::value_type(long(1)));
+      dataQueue[2].push(DataQueue::value_type(long(2)));
+      if(d == 0)
+        expected = output.str();
+      EXPECT_EQ(expected, output.str());
+    }
+}
+
+/*
+ * Benchmarks, run with --gtest_also_run_disabled_tests and a Release build.
+ */
+class BenchTimer
+{
+public:
+    BenchTimer()
+    :start(std::chrono::steady_clock::now())
+    {
+    }
+
+    double nanosPer(size_t count) const
+    {
+      std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+      return elapsed.count() / count;
+    }
+
+private:
+    std::chrono::steady_clock::time_point start;
+};
+
+// the copies DataQueue::push() and FromQueue::getNextValue() make
+template<typename Item, typename List>
+double listRoundTripNanos(List const& list, size_t rounds)
+{
+    Item slot;
+    Item value;
+    BenchTimer timer;
+    for(size_t i=0; i<rounds; ++i)
+    {
+      Item pushed(list);
+      slot = pushed;
+      value = slot;
+    }
+    double nanos = timer.nanosPer(rounds);
+    EXPECT_EQ(list.size(), boost::get<List>(value).size());
+    return nanos;
+}
+
+// queue round trips of list payloads, std::vector lists against BaseItemIDList
+TEST(FieldValueBench, DISABLED_QueueListThroughput)
+{
+    typedef std::vector<BaseItemID> VectorList;
+    typedef boost::make_variant_over<
+      mpl::push_back<
+        mpl::push_back<BaseTypes, BaseItemID>::type,
+        VectorList>::type>::type VectorQueueItem;
+
+    const size_t rounds = 1000000;
+    for(size_t length=1; length<=BaseItemIDListInline+1; ++length)
+    {
+      VectorList vectorList;
+      BaseItemIDList smallList;
+      for(size_t i=0; i<length; ++i)
+      {
+        vectorList.push_back(BaseItemID(int(i), BaseItem(long(i))));
+        smallList.push_back(BaseItemID(int(i), BaseItem(long(i))));
+      }
+
+      double vectorNanos = listRoundTripNanos<VectorQueueItem>(vectorList, rounds);
+      double smallNanos = listRoundTripNanos<QueueItem>(smallList, rounds);
+      std::cout << "list of " << length << ": std::vector " << vectorNanos
+                << " ns, BaseItemIDList " << smallNanos << " ns per push/pull\n";
+    }
+}
+
+// the best of several runs of push/update/serialize rounds on the tree
+template<typename Make>
+double scalarRoundNanos(DataQueue* queues, MultiFieldValue<DataQueue::value_type>& tree,
+                        std::ostream& output, Make make, size_t rounds)
+{
+    double best = 0;
+    for(size_t run=0; run<5; ++run)
+    {
+      BenchTimer timer;
+      for(size_t r=0; r<rounds; ++r)
+      {
+        for(size_t i=0; i<tree.fieldCount(); ++i)
+          queues[i].push(make(r + i));
+        tree.update();
+        tree.serializeTo(output);
+      }
+      double nanos = timer.nanosPer(rounds*tree.fieldCount());
+      if(!run || nanos < best)
+        best = nanos;
+    }
+    return best;
+}
+
+DataQueue::value_type makeLong(size_t i) { return DataQueue::value_type(long(i)); }
+DataQueue::value_type makeDouble(size_t i) { return DataQueue::value_type(double(i) / 4); }
+
+// scalar values through the queue and the tree, which pay for the size of
+// QueueItem in every queue slot, pulled copy and FieldValue
+TEST(FieldValueBench, DISABLED_ScalarQueueThroughput)
+{
+    const size_t numFields = 64;
+    const size_t rounds = 20000;
+    DataQueue dataQueue[numFields];
+    std::vector<FromQueue> fromQueue;
+    for(size_t i=0; i<numFields; ++i)
+      fromQueue.push_back(FromQueue(&dataQueue[i]));
+    MultiFieldValue<DataQueue::value_type> tree(1);
+    for(size_t i=0; i<numFields; ++i)
+      tree.addField(new FieldValueFromInput(fromQueue[i]));
+    NullStreamBuf nullBuf;
+    std::ostream nullOutput(&nullBuf);
+
+    double longNanos = scalarRoundNanos(dataQueue, tree, nullOutput, makeLong, rounds);
+    double doubleNanos = scalarRoundNanos(dataQueue, tree, nullOutput, makeDouble, rounds);
+
+    // the copies alone, as in listRoundTripNanos()
+    QueueItem slot;
+    QueueItem value;
+    BenchTimer copyTimer;
+    for(size_t i=0; i<rounds*numFields; ++i)
+    {
+      QueueItem pushed = QueueItem(long(i));
+      slot = pushed;
+      value = slot;
+    }
+    double copyNanos = copyTimer.nanosPer(rounds*numFields);
+    EXPECT_EQ(long(rounds*numFields - 1), boost::get<long>(value));
+
+    std::cout << "sizeof(QueueItem) " << sizeof(QueueItem) << ": long " << longNanos
+              << " ns, double " << doubleNanos << " ns per push/update/serialize, "
+              << copyNanos << " ns per long push/pull\n";
+}
+
+// frame-of-reference batches of narrow-range columns against fixed longs
+TEST(FieldValueBench, DISABLED_FrameOfReferenceColumns)
+{
+    const size_t numColumns = 16;
+    const size_t rows = 1024;
+    const size_t batches = 2000;
+    std::vector<long> values(rows*numColumns);
+    unsigned long seed = 12345;
+    for(size_t i=0; i<values.size(); ++i)
+    {
+      seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+      long base = long(i % numColumns) * 100000;
+      values[i] = base + long((seed >> 33) % (1u << (i % numColumns)));
+    }
+
+    ForColumnEncoder batch(numColumns);
+    NullStreamBuf nullBuf;
+    std::ostream nullOutput(&nullBuf);
+    BenchTimer encodeTimer;
+    for(size_t b=0; b<batches; ++b)
+    {
+      for(size_t r=0; r<rows; ++r)
+        batch.addRow(&values[r*numColumns]);
+      batch.writeTo(nullOutput);
+    }
+    double encodeNanos = encodeTimer.nanosPer(batches*rows*numColumns);
+
+    for(size_t r=0; r<rows; ++r)
+      batch.addRow(&values[r*numColumns]);
+    std::ostringstream output;
+    batch.writeTo(output);
+    std::string bytes = output.str();
+
+    ForColumnDecoder decoder;
+    BenchTimer decodeTimer;
+    for(size_t b=0; b<batches; ++b)
+      decoder.decode(bytes.data(), bytes.size());
+    double decodeNanos = decodeTimer.nanosPer(batches*rows*numColumns);
+
+    std::cout << rows << " rows x " << numColumns << " columns: " << bytes.size()
+              << " bytes against " << values.size()*sizeof(long) << " as fixed longs, encode "
+              << encodeNanos << " ns, decode " << decodeNanos << " ns per value\n";
+    EXPECT_EQ(values[rows*numColumns-1], decoder.columns()[numColumns-1][rows-1]);
+}
+
+// building a wide snapshot tree from its schema text
+TEST(FieldValueBench, DISABLED_SchemaLoad)
+{
+    const size_t numQueues = 64;
+    const size_t numFields = 10000;
+    DataQueue dataQueue[numQueues];
+    SchemaLoader loader;
+    std::string names[numQueues];
+    for(size_t q=0; q<numQueues; ++q)
+    {
+      names[q] = "queue" + std::to_string(q);
+      loader.bindQueue(names[q], &dataQueue[q]);
+    }
+    std::string text = "multi 1 {\n";
+    for(size_t f=0; f<numFields; ++f)
+      text += "  field " + names[f % numQueues] + (f % 2 ? " varint\n" : "\n");
+    text += "}\n";
+
+    const size_t rounds = 20;
+    BenchTimer parseTimer;
+    for(size_t i=0; i<rounds; ++i)
+      SchemaParser::parse(text);
+    double parseNanos = parseTimer.nanosPer(rounds);
+
+    SchemaDescription schema = SchemaParser::parse(text);
+    BenchTimer buildTimer;
+    for(size_t i=0; i<rounds; ++i)
+      loader.build(schema);
+    double buildNanos = buildTimer.nanosPer(rounds);
+
+    SchemaImage::save(schema, "SchemaLoad.bin");
+    BenchTimer imageTimer;
+    for(size_t i=0; i<rounds; ++i)
+    {
+      SchemaImage image("SchemaLoad.bin");
+      loader.build(image);
+    }
+    double imageNanos = imageTimer.nanosPer(rounds);
+    std::remove("SchemaLoad.bin");
+
+    std::cout << numFields << " fields: parse " << parseNanos / 1e6 << " ms, build "
+              << buildNanos / 1e6 << " ms, map image and build " << imageNanos / 1e6 << " ms\n";
+}
+
+// update and serialize rounds over a wide tree in the two node layouts
+// and with nodes allocated one by one in shuffled order
+TEST(FieldValueBench, DISABLED_CacheLineLayout)
+{
+    const size_t numQueues = 64;
+    const size_t numFields = 20000;
+    const size_t rounds = 200;
+    DataQueue dataQueue[numQueues];
+    std::vector<FromQueue> fromQueue;
+    SchemaLoader loader;
+    for(size_t q=0; q<numQueues; ++q)
+    {
+      dataQueue[q].push(DataQueue::value_type(long(q)));
+      fromQueue.push_back(FromQueue(&dataQueue[q]));
+      loader.bindQueue("queue" + std::to_string(q), &dataQueue[q]);
+    }
+    std::string text = "multi 1 {\n";
+    for(size_t f=0; f<numFields; ++f)
+      text += "  field queue" + std::to_string(f % numQueues) + "\n";
+    text += "}\n";
+    SchemaDescription schema = SchemaParser::parse(text);
+
+    MultiFieldValue<DataQueue::value_type>* heap = new MultiFieldValue<DataQueue::value_type>(1);
+    std::vector<FieldValueBase<DataQueue::value_type>*> leaves(numFields);
+    std::vector<std::string*> gaps;
+    unsigned long seed = 12345;
+    for(size_t i=0; i<numFields; ++i)
+    {
+      seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+      size_t f = (seed >> 33) % numFields;
+      while(leaves[f])
+        f = (f + 1) % numFields;
+      leaves[f] = new FieldValueFromInput(fromQueue[f % numQueues]);
+      gaps.push_back(new std::string(size_t(seed >> 58), 'x'));
+    }
+    for(size_t f=0; f<numFields; ++f)
+      heap->addField(leaves[f]);
+
+    SchemaLoader::FieldValueBase_ptr trees[3];
+    trees[0].reset(heap);
+    trees[1] = loader.build(schema);
+    loader.setNodeLayout(CacheLineLayout);
+    trees[2] = loader.build(schema);
+    const char* names[3] = { "shuffled heap", "preorder arena", "cache line layout" };
+
+    NullStreamBuf nullBuf;
+    std::ostream nullOutput(&nullBuf);
+    for(size_t t=0; t<3; ++t)
+    {
+      BenchTimer timer;
+      for(size_t r=0; r<rounds; ++r)
+      {
+        dataQueue[r % numQueues].push(DataQueue::value_type(long(r)));
+        trees[t]->update();
+        trees[t]->serializeTo(nullOutput);
+      }
+      std::cout << numFields << " fields, " << names[t] << ": "
+                << timer.nanosPer(rounds) / 1e3 << " us per round\n";
+    }
+    for(size_t i=0; i<gaps.size(); ++i)
+      delete gaps[i];
+}
+
+// update and serialize rounds over a wide tree by prefetch distance
+TEST(FieldValueBench, DISABLED_PrefetchDistance)
+{
+    const size_t numQueues = 64;
+    const size_t numFields = 50000;
+    const size_t rounds = 100;
+    DataQueue dataQueue[numQueues];
+    SchemaLoader loader;
+    for(size_t q=0; q<numQueues; ++q)
+    {
+      dataQueue[q].push(DataQueue::value_type(long(q)));
+      loader.bindQueue("queue" + std::to_string(q), &dataQueue[q]);
+    }
+    std::string text = "multi 1 {\n";
+    for(size_t f=0; f<numFields; ++f)
+    {
+      // a bits node of 64 fields in every thousand
+      std::string field = "field queue" + std::to_string(f % numQueues);
+      if(f % 1000 == 0)
+        text += "  bits 16 {";
+      if(f % 1000 < 64)
+        text += " 2 " + field + (f % 1000 == 63 ? " }\n" : "");
+      else
+        text += "  " + field + "\n";
+    }
+    text += "}\n";
+    SchemaDescription schema = SchemaParser::parse(text);
+
+    // plain fields allocated one by one in shuffled order
+    std::vector<FromQueue> fromQueue;
+    for(size_t q=0; q<numQueues; ++q)
+      fromQueue.push_back(FromQueue(&dataQueue[q]));
+    MultiFieldValue<DataQueue::value_type>* heap = new MultiFieldValue<DataQueue::value_type>(1);
+    std::vector<FieldValueBase<DataQueue::value_type>*> leaves(numFields);
+    std::vector<boost::shared_ptr<std::string> > gaps;
+    unsigned long seed = 12345;
+    for(size_t i=0; i<numFields; ++i)
+    {
+      seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+      size_t f = (seed >> 33) % numFields;
+      while(leaves[f])
+        f = (f + 1) % numFields;
+      leaves[f] = new FieldValueFromInput(fromQueue[f % numQueues]);
+      gaps.push_back(boost::shared_ptr<std::string>(new std::string(size_t(seed >> 58), 'x')));
+    }
+    for(size_t f=0; f<numFields; ++f)
+      heap->addField(leaves[f]);
+
+    SchemaLoader::FieldValueBase_ptr trees[3];
+    trees[0].reset(heap);
+    trees[1] = loader.build(schema);
+    loader.setNodeLayout(CacheLineLayout);
+    trees[2] = loader.build(schema);
+    const char* names[3] = { "shuffled heap", "preorder arena", "cache line layout" };
+
+    NullStreamBuf nullBuf;
+    std::ostream nullOutput(&nullBuf);
+    const size_t distances[] = { 0, 2, 4, 8, 16, 32 };
+    for(size_t t=0; t<3; ++t)
+    {
+      std::cout << numFields << " fields, " << names[t] << ":";
+      for(size_t d=0; d<sizeof(distances)/sizeof(distances[0]); ++d)
+      {
+        trees[t]->setPrefetchDistance(distances[d]);
+        BenchTimer timer;
+        for(size_t r=0; r<rounds; ++r)
+        {
+          dataQueue[r % numQueues].push(DataQueue::value_type(long(r)));
+          trees[t]->update();
+          trees[t]->serializeTo(nullOutput);
+        }
+        std::cout << " distance " << distances[d] << " " << timer.nanosPer(rounds) / 1e3 << " us";
+      }
+      std::cout << " per round\n";
+    }
+}
+
+// encoding all repetitions of a wide snapshot on one thread and on a pool
+TEST(FieldValueBench, DISABLED_ParallelRepetitions)
+{
+    const size_t numRepeat = 20000;
+    const size_t numFields = 4;
+    const size_t rounds = 50;
+    DataQueue dataQueue[numFields];
+    std::vector<FromQueue> fromQueue;
+    for(size_t f=0; f<numFields; ++f)
+      fromQueue.push_back(FromQueue(&dataQueue[f]));
+
+    size_t numThreads = std::max(1u, std::thread::hardware_concurrency()) - 1;
+    TaskPool pool(numThreads);
+    MultiFieldValue<DataQueue::value_type> serial(numRepeat);
+    MultiFieldValue<DataQueue::value_type> parallel(numRepeat);
+    parallel.setParallel(&pool, 1);
+    for(size_t f=0; f<numFields; ++f)
+    {
+      serial.addField(new FieldValueFromInput(fromQueue[f]));
+      parallel.addField(new FieldValueFromInput(fromQueue[f]));
+    }
+
+    NullStreamBuf nullBuf;
+    std::ostream nullOutput(&nullBuf);
+    double nanos[2];
+    MultiFieldValue<DataQueue::value_type>* trees[2] = { &serial, &parallel };
+    for(size_t t=0; t<2; ++t)
+    {
+      BenchTimer timer;
+      for(size_t r=0; r<rounds; ++r)
+      {
+        for(size_t f=0; f<numFields; ++f)
+          dataQueue[f].push(DataQueue::value_type(long(r*1000 + f)));
+        trees[t]->update();
+        trees[t]->serializeTo(nullOutput);
+      }
+      nanos[t] = timer.nanosPer(rounds);
+    }
+    std::cout << numRepeat << " repetitions x " << numFields << " fields: serial "
+              << nanos[0] / 1e3 << " us, " << numThreads << " pool threads + caller "
+              << nanos[1] / 1e3 << " us per record\n";
+}
+
+// compression ratio and throughput of serialized records by block size
+TEST(FieldValueBench, DISABLED_BlockCompression)
+{
+    const size_t numRepeat = 64;
+    const size_t numFields = 8;
+    const size_t records = 2000;
+    DataQueue dataQueue[numFields];
+    std::vector<FromQueue> fromQueue;
+    for(size_t f=0; f<numFields; ++f)
+      fromQueue.push_back(FromQueue(&dataQueue[f]));
+    MultiFieldValue<DataQueue::value_type> multi(numRepeat);
+    for(size_t f=0; f<numFields; ++f)
+      multi.addField(new FieldValueFromInput(fromQueue[f]));
+
+    std::ostringstream recordOutput;
+    unsigned long seed = 12345;
+    for(size_t r=0; r<records; ++r)
+    {
+      seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+      dataQueue[r % numFields].push(DataQueue::value_type(long(100000 + (seed >> 50))));
+      multi.update();
+      multi.serializeTo(recordOutput);
+    }
+    std::string raw = recordOutput.str();
+
+    std::cout << "L2 default block " << CompressingStreamBuf::defaultBlockSize() << " bytes\n";
+    for(size_t blockSize=1024; blockSize<=256*1024; blockSize*=4)
+    {
+      std::string packed;
+      StringAppendBuf packedBuf(&packed);
+      BenchTimer compressTimer;
+      {
+        CompressingStreamBuf compressBuf(&packedBuf, blockSize);
+        std::ostream compressOutput(&compressBuf);
+        compressOutput.write(raw.data(), raw.size());
+        compressOutput.flush();
+      }
+      double compressNanos = compressTimer.nanosPer(raw.size());
+      std::string restored;
+      restored.reserve(raw.size());
+      BenchTimer decompressTimer;
+      BlockDecompressor(blockSize).decode(packed.data(), packed.size(), restored);
+      double decompressNanos = decompressTimer.nanosPer(raw.size());
+      EXPECT_EQ(raw, restored);
+      std::cout << blockSize << " byte blocks: ratio " << double(raw.size()) / packed.size()
+                << ", compress " << 1 / compressNanos << " GB/s, decompress "
+                << 1 / decompressNanos << " GB/s\n";
+    }
+}
+
+#ifdef GATHEROUTPUT_WRITEV
+// records with a constant header written with write() and with writev()
+TEST(FieldValueBench, DISABLED_GatherOutput)
+{
+    const size_t rounds = 20000;
+    FromDefault title(DataQueue::value_type(std::string(512, 'h')));
+    FieldValueDefault header(title);
+    header.foldConstants();
+    DataQueue dataQueue[4];
+    std::vector<FromQueue> fromQueue;
+    for(size_t f=0; f<4; ++f)
+      fromQueue.push_back(FromQueue(&dataQueue[f]));
+    MultiFieldValue<DataQueue::value_type> multi(128);
+    for(size_t f=0; f<4; ++f)
+      multi.addField(new FieldValueFromInput(fromQueue[f]));
+
+    int fd = open("/dev/null", O_WRONLY);
+    ASSERT_LE(0, fd);
+    std::string bytes;
+    StringAppendBuf bytesBuf(&bytes);
+    std::ostream bytesOutput(&bytesBuf);
+    BenchTimer copyTimer;
+    for(size_t r=0; r<rounds; ++r)
+    {
+      dataQueue[r % 4].push(DataQueue::value_type(long(r)));
+      multi.update();
+      bytes.clear();
+      header.serializeTo(bytesOutput);
+      multi.serializeTo(bytesOutput);
+      ASSERT_EQ(ssize_t(bytes.size()), write(fd, bytes.data(), bytes.size()));
+    }
+    double copyNanos = copyTimer.nanosPer(rounds);
+
+    GatherOutput gather;
+    BenchTimer gatherTimer;
+    for(size_t r=0; r<rounds; ++r)
+    {
+      dataQueue[r % 4].push(DataQueue::value_type(long(r)));
+      multi.update();
+      gather.clear();
+      header.serializeSegmentsTo(gather);
+      multi.serializeSegmentsTo(gather);
+      gather.writeTo(fd);
+    }
+    double gatherNanos = gatherTimer.nanosPer(rounds);
+    close(fd);
+    std::cout << bytes.size() << " byte records: copy and write " << copyNanos
+              << " ns, gather and writev " << gatherNanos << " ns per record\n";
+}
+#endif
+
+// CRC-32C throughput with and without the crc32 instruction
+TEST(FieldValueBench, DISABLED_Crc32c)
+{
+    std::string data(64*1024, 'x');
+    for(size_t i=0; i<data.size(); ++i)
+      data[i] = char(i * 31);
+    const size_t rounds = 2000;
+    boost::uint32_t crc = 0;
+    BenchTimer softwareTimer;
+    for(size_t r=0; r<rounds/10; ++r)
+      crc ^= Crc32c::updateSoftware(0, data.data(), data.size());
+    double softwareNanos = softwareTimer.nanosPer(rounds/10 * data.size());
+    BenchTimer timer;
+    for(size_t r=0; r<rounds; ++r)
+      crc ^= Crc32c::compute(data.data(), data.size());
+    double nanos = timer.nanosPer(rounds * data.size());
+    std::cout << "CRC-32C: table " << 1 / softwareNanos << " GB/s, "
+              << (Crc32c::hardware() ? "crc32 instruction " : "no crc32 instruction, table ")
+              << 1 / nanos << " GB/s (" << crc << ")\n";
+}
+
+TEST(FieldValueTest, SteadyStateAllocations)
+{
+    DataQueue       dataQueue[4];
+    std::vector<FromQueue> fromQueue;
+    for(size_t i=0; i<4; ++i)
+    {
+      dataQueue[i].push(DataQueue::value_type(long(i+1)));
+      fromQueue.push_back(FromQueue(&dataQueue[i]));
+    }
+
+    MultiFieldValue<DataQueue::value_type> multi(3);
+    multi.addField(new FieldValueFromInput(fromQueue[0]));
+    multi.addField(new FieldValueFromInput(fromQueue[1]));
+    EXPECT_TRUE(NoSteadyStateAllocations(multi));
+
+    BitSetValue<DataQueue::value_type> bitsetValue(1);
+    bitsetValue.addBits(4, new FieldValueFromInput(fromQueue[2]));
+    bitsetValue.addBits(4, new FieldValueFromInput(fromQueue[3]));
+    EXPECT_TRUE(NoSteadyStateAllocations(bitsetValue));
+}
+
 #endif
@@ -0,0 +1,153 @@
+// -*- c++ -*-
+#ifndef FORCODEC_H
+#define FORCODEC_H
+
+#include <algorithm>
+#include <cstddef>
+#include <exception>
+#include <limits>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "deltacodec.h"
+#include "varint.h"
+
+/*
+ * Frame-of-reference batches of numeric columns.  Each column of a batch
+ * stores its minimum and packs the offsets of all its values from that
+ * minimum at the smallest bit width that holds the largest offset:
+ *
+ *   varint row count, varint column count, then per column
+ *   the minimum as zigzag varint, the bit width as one byte and the
+ *   offsets packed LSB-first like BitSetValue fields, padded to a byte.
+ *
+ * A column whose values are all equal takes no offset bits at all.
+ */
+class ForColumnEncoder
+{
+public:
+    explicit ForColumnEncoder(size_t numColumns)
+    :columns(numColumns)
+    {
+    }
+
+    size_t columnCount() const { return columns.size(); }
+    size_t rowCount() const { return columns.empty() ? 0 : columns[0].size(); }
+
+    void addRow(const long* values)
+    {
+      for(size_t c=0; c<columns.size(); ++c)
+        columns[c].push_back(values[c]);
+    }
+
+    static size_t bitWidth(unsigned long range)
+    {
+      size_t width = 0;
+      while(range)
+      {
+        range >>= 1;
+        ++width;
+      }
+      return width;
+    }
+
+    // writes the rows added so far as one batch and starts the next one
+    void writeTo(std::ostream& output)
+    {
+      size_t rows = rowCount();
+      buffer.clear();
+      char header[2*Varint::MaxBytes];
+      buffer.append(header, Varint::encode(columns.size(), Varint::encode(rows, header)));
+
+      for(size_t c=0; c<columns.size(); ++c)
+      {
+        std::vector<long> const& column = columns[c];
+        long minimum = rows ? column[0] : 0;
+        long maximum = minimum;
+        for(size_t r=1; r<rows; ++r)
+        {
+          minimum = std::min(minimum, column[r]);
+          maximum = std::max(maximum, column[r]);
+        }
+        size_t width = bitWidth((unsigned long)maximum - (unsigned long)minimum);
+
+        buffer.append(header, Varint::encode(ZigZag::encode(minimum), header));
+        buffer.push_back(char(width));
+        BitWriter writer(buffer);
+        for(size_t r=0; r<rows; ++r)
+          writer.write((unsigned long)column[r] - (unsigned long)minimum, width);
+        writer.flush();
+      }
+      output.write(buffer.data(), buffer.size());
+
+      for(size_t c=0; c<columns.size(); ++c)
+        columns[c].clear();
+    }
+
+private:
+    std::vector<std::vector<long> > columns;
+    std::string buffer;
+};
+
+/*
+ * Counts are checked against the input before anything is sized by them:
+ * every column takes at least its minimum and width bytes, and its
+ * offsets at least rows*width bits.  Columns of equal values take no
+ * offset bits, so the row count is bounded by maxRows as well; readers
+ * pass the batch size of the writer.
+ */
+class ForColumnDecoder
+{
+public:
+    typedef BitReader::Truncated Truncated;
+    struct Malformed : public std::exception {};
+
+    static const size_t DefaultMaxRows = 1 << 20;
+
+    explicit ForColumnDecoder(size_t maxRows = DefaultMaxRows)
+    :maxRowCount(maxRows)
+    {
+    }
+
+    // decodes one batch and returns the number of bytes it took
+    size_t decode(const char* data, size_t size)
+    {
+      const char* pos = data;
+      const char* end = data + size;
+      size_t rows = Varint::decode(pos, end);
+      size_t numColumns = Varint::decode(pos, end);
+      if(rows > maxRowCount || numColumns > size_t(end - pos) / 2)
+        throw Malformed();
+      decoded.resize(numColumns);
+
+      for(size_t c=0; c<numColumns; ++c)
+      {
+        unsigned long minimum = ZigZag::decode(Varint::decode(pos, end));
+        if(pos == end)
+          throw Truncated();
+        size_t width = (unsigned char)*pos++;
+        if(width > size_t(std::numeric_limits<unsigned long>::digits))
+          throw Malformed();
+        if(width && rows > size_t(end - pos) * 8 / width)
+          throw Truncated();
+        BitReader reader(pos, end - pos);
+        std::vector<long>& column = decoded[c];
+        column.resize(rows);
+        for(size_t r=0; r<rows; ++r)
+          column[r] = long(minimum + reader.read(width));
+        reader.align();
+        pos = reader.position();
+      }
+      return pos - data;
+    }
+
+    // the values of the last batch per column
+    std::vector<std::vector<long> > const& columns() const { return decoded; }
+
+private:
+    size_t maxRowCount;
+    std::vector<std::vector<long> > decoded;
+};
+
+#endif
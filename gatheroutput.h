@@ -0,0 +1,176 @@
+// -*- c++ -*-
+#ifndef GATHEROUTPUT_H
+#define GATHEROUTPUT_H
+
+#include <algorithm>
+#include <cstddef>
+#include <exception>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <cerrno>
+#include <climits>
+#include <sys/uio.h>
+#define GATHEROUTPUT_WRITEV 1
+#else
+struct iovec
+{
+    void* iov_base;
+    size_t iov_len;
+};
+#endif
+
+#include "streambufs.h"
+
+/*
+ * A record as a list of byte ranges for writev()/sendmsg(): references
+ * to bytes the tree keeps encoded anyway, folded constants and caches of
+ * unchanged subtrees, in between bytes freshly encoded into a buffer of
+ * its own.  Only the fresh bytes are copied.
+ *
+ * References shorter than minReference bytes are copied all the same,
+ * a small copy is cheaper than another iovec for the kernel to walk.
+ * Referenced bytes stay valid until the tree is updated or serialized
+ * again, so the list has to be written out before that.
+ */
+class GatherOutput
+{
+public:
+    struct WriteFailed : public std::exception {};
+
+    explicit GatherOutput(size_t minReference = 64)
+    :minimum(minReference), buf(&bytes), output(&buf), copiedEnd(0),
+     referenced(0), vectorsCurrent(false)
+    {
+    }
+
+    // where nodes encode their fresh bytes
+    std::ostream& stream() { return output; }
+
+    void addReference(const char* data, size_t size)
+    {
+      if(size < minimum)
+      {
+        output.write(data, size);
+        return;
+      }
+      closeCopied();
+      Segment segment = { data, 0, size };
+      segments.push_back(segment);
+      referenced += size;
+      vectorsCurrent = false;
+    }
+
+    void clear()
+    {
+      bytes.clear();
+      segments.clear();
+      copiedEnd = 0;
+      referenced = 0;
+      vectorsCurrent = false;
+    }
+
+    size_t size() const { return referenced + bytes.size(); }
+    size_t referencedBytes() const { return referenced; }
+    size_t copiedBytes() const { return bytes.size(); }
+
+    // the ranges, valid until anything is added
+    const struct iovec* iovecs() { buildVectors(); return vectors.empty() ? 0 : &vectors[0]; }
+    size_t iovecCount() { buildVectors(); return vectors.size(); }
+
+    // for streams: writes all ranges in order
+    void copyTo(std::ostream& target)
+    {
+      buildVectors();
+      for(size_t v=0; v<vectors.size(); ++v)
+        target.write(static_cast<const char*>(vectors[v].iov_base), vectors[v].iov_len);
+    }
+
+#ifdef GATHEROUTPUT_WRITEV
+    // writes everything to fd, resuming after partial writes and signals
+    void writeTo(int fd)
+    {
+      buildVectors();
+      size_t first = 0;
+      while(first < vectors.size())
+      {
+        size_t count = std::min(vectors.size() - first, size_t(IOV_MAX));
+        ssize_t written = ::writev(fd, &vectors[first], int(count));
+        if(written < 0)
+        {
+          if(errno == EINTR)
+            continue;
+          vectorsCurrent = false;
+          throw WriteFailed();
+        }
+        for(size_t left = size_t(written); left; )
+        {
+          struct iovec& vector = vectors[first];
+          size_t used = std::min(left, size_t(vector.iov_len));
+          vector.iov_base = static_cast<char*>(vector.iov_base) + used;
+          vector.iov_len -= used;
+          left -= used;
+          if(!vector.iov_len)
+            ++first;
+        }
+        while(first < vectors.size() && !vectors[first].iov_len)
+          ++first;
+      }
+      // the vectors were used up
+      vectorsCurrent = false;
+    }
+#endif
+
+private:
+    GatherOutput(GatherOutput const&);
+    GatherOutput& operator=(GatherOutput const&);
+
+    // data 0 stands for the copied bytes at offset; the buffer may still
+    // move while the list grows
+    struct Segment
+    {
+        const char* data;
+        size_t offset;
+        size_t size;
+    };
+
+    void closeCopied()
+    {
+      if(bytes.size() == copiedEnd)
+        return;
+      Segment segment = { 0, copiedEnd, bytes.size() - copiedEnd };
+      segments.push_back(segment);
+      copiedEnd = bytes.size();
+      vectorsCurrent = false;
+    }
+
+    void buildVectors()
+    {
+      closeCopied();
+      if(vectorsCurrent)
+        return;
+      vectors.resize(segments.size());
+      for(size_t s=0; s<segments.size(); ++s)
+      {
+        Segment const& segment = segments[s];
+        const char* data = segment.data ? segment.data : bytes.data() + segment.offset;
+        vectors[s].iov_base = const_cast<char*>(data);
+        vectors[s].iov_len = segment.size;
+      }
+      vectorsCurrent = true;
+    }
+
+    size_t minimum;
+    std::string bytes;
+    StringAppendBuf buf;
+    std::ostream output;
+    size_t copiedEnd;
+    size_t referenced;
+    std::vector<Segment> segments;
+    std::vector<struct iovec> vectors;
+    bool vectorsCurrent;
+};
+
+#endif
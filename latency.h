@@ -0,0 +1,161 @@
+// -*- c++ -*-
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <chrono>
+#include <cstddef>
+#include <cstring>
+#include <ostream>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+/*
+ * Cheap timestamps for latency measurement: the time stamp counter where
+ * there is one, steady_clock nanoseconds elsewhere.  Ticks only make sense
+ * as differences; nanosPerTick() converts them.
+ */
+class LatencyClock
+{
+public:
+    typedef unsigned long long Ticks;
+
+    static Ticks now()
+    {
+#if defined(__x86_64__) || defined(__i386__)
+      return __rdtsc();
+#else
+      return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+    }
+
+    // measured against steady_clock on first use, which takes a few ms
+    static double nanosPerTick()
+    {
+#if defined(__x86_64__) || defined(__i386__)
+      static const double ratio = calibrate();
+      return ratio;
+#else
+      return 1.0;
+#endif
+    }
+
+private:
+    static double calibrate()
+    {
+      std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+      Ticks startTicks = now();
+      std::chrono::steady_clock::time_point end;
+      do
+        end = std::chrono::steady_clock::now();
+      while(end - start < std::chrono::milliseconds(10));
+      Ticks ticks = now() - startTicks;
+      std::chrono::duration<double, std::nano> elapsed = end - start;
+      return ticks ? elapsed.count() / ticks : 1.0;
+    }
+};
+
+/*
+ * A log-linear histogram in the manner of HdrHistogram: values below
+ * SubBuckets are counted exactly, larger ones in SubBuckets buckets per
+ * power of two, so every bucket is within 1/SubBuckets of its values.
+ * Recording is a few instructions on a fixed array and takes no lock; a
+ * histogram belongs to the thread that records into it.
+ */
+class LatencyHistogram
+{
+public:
+    static const unsigned SubBucketBits = 4;
+    static const unsigned long long SubBuckets = 1ULL << SubBucketBits;
+    static const size_t NumBuckets = (64 - SubBucketBits + 1) * SubBuckets;
+
+    LatencyHistogram()
+    {
+      reset();
+    }
+
+    void reset()
+    {
+      std::memset(counts, 0, sizeof(counts));
+      total = 0;
+      maximum = 0;
+    }
+
+    void record(unsigned long long value)
+    {
+      ++counts[bucketOf(value)];
+      ++total;
+      if(value > maximum)
+        maximum = value;
+    }
+
+    unsigned long long count() const { return total; }
+    unsigned long long max() const { return maximum; }
+
+    // The highest value of the bucket holding the given percentile, 0 to
+    // 100, but no more than the largest value recorded; 0 when empty.
+    unsigned long long percentile(double percent) const
+    {
+      if(!total)
+        return 0;
+      unsigned long long rank = (unsigned long long)(percent / 100 * total + 0.5);
+      if(rank < 1)
+        rank = 1;
+      unsigned long long seen = 0;
+      for(size_t b=0; b<NumBuckets; ++b)
+      {
+        seen += counts[b];
+        if(seen >= rank)
+          return highestOf(b) < maximum ? highestOf(b) : maximum;
+      }
+      return maximum;
+    }
+
+    // writes the usual percentiles, scaled by unit to nanoseconds
+    void reportTo(std::ostream& output, double nanosPerUnit) const
+    {
+      static const double percents[] = { 50, 90, 99, 99.9 };
+      output << "count " << total;
+      for(size_t i=0; i<sizeof(percents)/sizeof(percents[0]); ++i)
+        output << " p" << percents[i] << " " << (unsigned long long)(percentile(percents[i]) * nanosPerUnit);
+      output << " max " << (unsigned long long)(maximum * nanosPerUnit) << " ns";
+    }
+
+    static size_t bucketOf(unsigned long long value)
+    {
+      if(value < SubBuckets)
+        return size_t(value);
+      unsigned shift = highestBit(value) - SubBucketBits;
+      return size_t((shift + 1) * SubBuckets + ((value >> shift) & (SubBuckets - 1)));
+    }
+
+    static unsigned long long highestOf(size_t bucket)
+    {
+      if(bucket < SubBuckets)
+        return bucket;
+      unsigned shift = unsigned(bucket / SubBuckets - 1);
+      unsigned long long lowest = (SubBuckets + bucket % SubBuckets) << shift;
+      return lowest + ((1ULL << shift) - 1);
+    }
+
+private:
+    static unsigned highestBit(unsigned long long value)
+    {
+#ifdef __GNUC__
+      return 63 - __builtin_clzll(value);
+#else
+      unsigned bit = 0;
+      while(value >>= 1)
+        ++bit;
+      return bit;
+#endif
+    }
+
+    unsigned long long counts[NumBuckets];
+    unsigned long long total;
+    unsigned long long maximum;
+};
+
+#endif
@@ -0,0 +1,143 @@
+// -*- c++ -*-
+#ifndef NODEARENA_H
+#define NODEARENA_H
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+/*
+ * Bump allocation of the nodes of one field tree into a few large chunks,
+ * so that nodes built together sit next to each other in memory.  Objects
+ * made by create() are destroyed in reverse order of creation when the
+ * arena goes away; nothing is freed before that.
+ */
+class NodeArena
+{
+public:
+    static const size_t CacheLineSize = 64;
+
+    explicit NodeArena(size_t chunkBytes = 64*1024)
+    :chunkSize(chunkBytes), next(0), left(0), pendingAlignment(1)
+    {
+    }
+
+    ~NodeArena()
+    {
+      for(size_t i=destructors.size(); i>0; --i)
+        destructors[i-1].first(destructors[i-1].second);
+      for(size_t i=0; i<chunks.size(); ++i)
+        ::operator delete(chunks[i]);
+    }
+
+    void* allocate(size_t bytes, size_t alignment)
+    {
+      if(pendingAlignment > alignment)
+        alignment = pendingAlignment;
+      pendingAlignment = 1;
+      size_t padding = (alignment - reinterpret_cast<size_t>(next) % alignment) % alignment;
+      if(padding + bytes > left)
+      {
+        // oversized requests get a chunk of their own
+        size_t size = bytes + alignment > chunkSize ? bytes + alignment : chunkSize;
+        next = static_cast<char*>(::operator new(size));
+        chunks.push_back(next);
+        left = size;
+        padding = (alignment - reinterpret_cast<size_t>(next) % alignment) % alignment;
+      }
+      void* result = next + padding;
+      next += padding + bytes;
+      left -= padding + bytes;
+      return result;
+    }
+
+    // lets the next object start at an alignment boundary
+    void alignTo(size_t alignment)
+    {
+      pendingAlignment = alignment;
+    }
+
+    template<typename T, typename... Args>
+    T* create(Args&&... args)
+    {
+      void* place = allocate(sizeof(T), alignof(T));
+      T* object = new(place) T(std::forward<Args>(args)...);
+      if(!std::is_trivially_destructible<T>::value)
+        destructors.push_back(std::make_pair(&destroy<T>, static_cast<void*>(object)));
+      return object;
+    }
+
+    size_t chunkCount() const { return chunks.size(); }
+
+private:
+    NodeArena(NodeArena const&);
+    NodeArena& operator=(NodeArena const&);
+
+    template<typename T>
+    static void destroy(void* object)
+    {
+      static_cast<T*>(object)->~T();
+    }
+
+    size_t chunkSize;
+    char* next;
+    size_t left;
+    size_t pendingAlignment;
+    std::vector<char*> chunks;
+    std::vector<std::pair<void (*)(void*), void*> > destructors;
+};
+
+// puts shared_ptr control blocks into the arena as well
+template<typename T>
+class ArenaAllocator
+{
+public:
+    typedef T value_type;
+
+    explicit ArenaAllocator(NodeArena& nodeArena)
+    :arena(&nodeArena)
+    {
+    }
+
+    template<typename U>
+    ArenaAllocator(ArenaAllocator<U> const& other)
+    :arena(other.arena)
+    {
+    }
+
+    T* allocate(size_t count)
+    {
+      return static_cast<T*>(arena->allocate(count * sizeof(T), alignof(T)));
+    }
+
+    void deallocate(T*, size_t)
+    {
+    }
+
+    NodeArena* arena;
+};
+
+template<typename T, typename U>
+bool operator==(ArenaAllocator<T> const& lhs, ArenaAllocator<U> const& rhs)
+{
+    return lhs.arena == rhs.arena;
+}
+
+template<typename T, typename U>
+bool operator!=(ArenaAllocator<T> const& lhs, ArenaAllocator<U> const& rhs)
+{
+    return lhs.arena != rhs.arena;
+}
+
+// for shared_ptrs to arena objects, which the arena destroys itself
+struct ArenaNoDelete
+{
+    template<typename T>
+    void operator()(T*) const
+    {
+    }
+};
+
+#endif
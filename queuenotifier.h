@@ -0,0 +1,172 @@
+// -*- c++ -*-
+#ifndef QUEUENOTIFIER_H
+#define QUEUENOTIFIER_H
+
+#include "dataqueue.h"
+
+/*
+ * Readiness notification of DataQueues through file descriptors, for
+ * consumers driven by an epoll loop instead of coroutines (Linux only).
+ *
+ * A QueueNotifier listens to the queues of one tree and owns an eventfd
+ * that becomes readable on the first push after the last drain(); further
+ * pushes until then do not touch the descriptor again, so a burst costs
+ * one write() and one wakeup.  An EpollLoop waits on many notifiers and
+ * calls the handler of each ready one once per wakeup.  Notifiers only
+ * tell the loop's thread to look; it takes the values under the lock
+ * DataQueue asks for.
+ */
+#ifdef __linux__
+
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <functional>
+#include <system_error>
+#include <vector>
+
+#include <boost/shared_ptr.hpp>
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+class QueueNotifier : public DataQueueListener
+{
+public:
+    QueueNotifier()
+    :descriptor(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)), signalled(false), writes(0)
+    {
+      if(descriptor < 0)
+        throw std::system_error(errno, std::system_category(), "eventfd");
+    }
+
+    ~QueueNotifier()
+    {
+      for(size_t i=0; i<queues.size(); ++i)
+        queues[i]->removeListener(this);
+      close(descriptor);
+    }
+
+    // registers as a listener of the queue, next to any others
+    void watch(DataQueue& queue)
+    {
+      queue.addListener(this);
+      queues.push_back(&queue);
+    }
+
+    int fd() const { return descriptor; }
+
+    // the eventfd writes so far, one per burst of pushes
+    unsigned long notifications() const { return writes; }
+
+    void pushed(DataQueue&)
+    {
+      if(!signalled.exchange(true))
+      {
+        ++writes;
+        eventfd_write(descriptor, 1);
+      }
+    }
+
+    // Rearms the notifier and returns whether it had been signalled.  The
+    // descriptor is read before the flag is cleared: a push in between
+    // does not signal again, but its value is already in the queue when
+    // the consumer goes on to take the values.
+    bool drain()
+    {
+      eventfd_t count;
+      if(eventfd_read(descriptor, &count) != 0)
+        return false;
+      signalled.store(false);
+      return true;
+    }
+
+private:
+    QueueNotifier(QueueNotifier const&);
+    QueueNotifier& operator=(QueueNotifier const&);
+
+    int descriptor;
+    std::atomic<bool> signalled;
+    std::atomic<unsigned long> writes;
+    std::vector<DataQueue*> queues;
+};
+
+class EpollLoop
+{
+public:
+    typedef std::function<void ()> Handler;
+
+    // room for this many ready notifiers per wait
+    explicit EpollLoop(size_t maxEvents = 64)
+    :descriptor(epoll_create1(EPOLL_CLOEXEC)), events(maxEvents)
+    {
+      if(descriptor < 0)
+        throw std::system_error(errno, std::system_category(), "epoll_create1");
+    }
+
+    ~EpollLoop()
+    {
+      close(descriptor);
+    }
+
+    // the handler runs on the thread calling runOnce(), after the
+    // notifier was drained, typically update() and serializeTo() of a tree
+    void add(QueueNotifier& notifier, Handler handler)
+    {
+      boost::shared_ptr<Entry> entry(new Entry(notifier, handler));
+      epoll_event event = epoll_event();
+      event.events = EPOLLIN;
+      event.data.ptr = entry.get();
+      if(epoll_ctl(descriptor, EPOLL_CTL_ADD, notifier.fd(), &event) < 0)
+        throw std::system_error(errno, std::system_category(), "epoll_ctl");
+      entries.push_back(entry);
+    }
+
+    // Waits up to timeoutMillis (-1 for ever) and runs the handlers of the
+    // notifiers that became ready; returns the number of handlers run.
+    size_t runOnce(int timeoutMillis)
+    {
+      int ready = epoll_wait(descriptor, &events[0], int(events.size()), timeoutMillis);
+      if(ready < 0)
+      {
+        if(errno == EINTR)
+          return 0;
+        throw std::system_error(errno, std::system_category(), "epoll_wait");
+      }
+      size_t handled = 0;
+      for(int i=0; i<ready; ++i)
+      {
+        Entry& entry = *static_cast<Entry*>(events[i].data.ptr);
+        if(entry.notifier.drain())
+        {
+          entry.handler();
+          ++handled;
+        }
+      }
+      return handled;
+    }
+
+private:
+    struct Entry
+    {
+        Entry(QueueNotifier& entryNotifier, Handler entryHandler)
+        :notifier(entryNotifier), handler(entryHandler)
+        {
+        }
+
+        QueueNotifier& notifier;
+        Handler handler;
+    };
+
+    EpollLoop(EpollLoop const&);
+    EpollLoop& operator=(EpollLoop const&);
+
+    int descriptor;
+    std::vector<epoll_event> events;
+    std::vector<boost::shared_ptr<Entry> > entries;
+};
+
+#endif
+
+#endif
@@ -0,0 +1,354 @@
+// -*- c++ -*-
+#ifndef SCHEMA_H
+#define SCHEMA_H
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <boost/cstdint.hpp>
+
+/*
+ * Declarative description of a field tree.  The text form is a sequence
+ * of whitespace separated tokens, '#' comments run to the end of a line:
+ *
+ *   node     := "multi" repeat "{" node* "}"
+ *             | "bits" bytes "{" (width leaf)* "}"
+ *             | leaf
+ *   leaf     := "field" queue [encoding]
+ *             | "tlv" queue
+ *             | "const" number
+ *   encoding := "text" | "varint" | "zigzag" | "fixed"
+ *
+ * A schema holds exactly one top level node.  Queues are referred to by
+ * name and bound when the tree is built; a const becomes a FromDefault of
+ * the long, or with a '.' or exponent the double, it spells.
+ *
+ * Parsing yields a SchemaDescription: the nodes in preorder, each multi
+ * or bits node followed by the subtrees of its children, with all names
+ * in one buffer.  The nodes are plain fixed-size records so that a
+ * description can be stored and used as it is.
+ */
+enum SchemaNodeKind
+{
+    SchemaMulti = 1,
+    SchemaBits = 2,
+    SchemaField = 3,
+    SchemaTlv = 4,
+    SchemaConstLong = 5,
+    SchemaConstDouble = 6
+};
+
+struct SchemaNode
+{
+    boost::uint8_t kind;
+    // FieldEncoding of a field, in the order of the encoding keywords
+    boost::uint8_t encoding;
+    // the width of a leaf inside a bits node
+    boost::uint16_t bits;
+    // the number of direct children of a multi or bits node
+    boost::uint32_t children;
+    // the repeat count of a multi, the byte count of a bits node
+    boost::uint64_t size;
+    // the bits of a const, a double as its IEEE 754 pattern
+    boost::uint64_t constant;
+    // the queue name of a field or tlv leaf in SchemaDescription::names
+    boost::uint32_t nameOffset;
+    boost::uint32_t nameLength;
+};
+
+struct SchemaDescription
+{
+    std::vector<SchemaNode> nodes;
+    std::string names;
+};
+
+class SchemaError : public std::runtime_error
+{
+public:
+    SchemaError(std::string const& message, size_t line)
+    :std::runtime_error(message + " at line " + lineText(line)), line_(line)
+    {
+    }
+
+    explicit SchemaError(std::string const& message)
+    :std::runtime_error(message), line_(0)
+    {
+    }
+
+    // 0 for errors found after parsing
+    size_t line() const { return line_; }
+
+private:
+    static std::string lineText(size_t line)
+    {
+      char buf[24];
+      std::snprintf(buf, sizeof(buf), "%lu", (unsigned long)line);
+      return buf;
+    }
+
+    size_t line_;
+};
+
+class SchemaParser
+{
+public:
+    static SchemaDescription parse(std::string const& text)
+    {
+      SchemaParser parser(text);
+      SchemaDescription schema;
+      parser.parseNode(schema, false);
+      if(parser.nextToken())
+        parser.fail("text after the top level node");
+      return schema;
+    }
+
+private:
+    explicit SchemaParser(std::string const& text)
+    :pos(text.data()), end(text.data() + text.size()), token(0), length(0), line(1)
+    {
+    }
+
+    void fail(const char* message) const
+    {
+      throw SchemaError(message, line);
+    }
+
+    // the next token in token/length; false at the end of the text
+    bool nextToken()
+    {
+      for(;;)
+      {
+        while(pos != end && (*pos == ' ' || *pos == '\t' || *pos == '\r' || *pos == '\n'))
+          if(*pos++ == '\n')
+            ++line;
+        if(pos == end || *pos != '#')
+          break;
+        while(pos != end && *pos != '\n')
+          ++pos;
+      }
+      if(pos == end)
+        return false;
+      token = pos;
+      if(*pos == '{' || *pos == '}')
+        ++pos;
+      else
+        while(pos != end && !std::strchr(" \t\r\n{}#", *pos))
+          ++pos;
+      length = pos - token;
+      return true;
+    }
+
+    void expectToken(const char* what)
+    {
+      if(!nextToken())
+        fail(what);
+    }
+
+    bool is(const char* keyword) const
+    {
+      return std::strlen(keyword) == length && std::memcmp(token, keyword, length) == 0;
+    }
+
+    unsigned long parseCount(const char* what)
+    {
+      expectToken(what);
+      std::string digits(token, length);
+      char* stop;
+      errno = 0;
+      unsigned long value = std::strtoul(digits.c_str(), &stop, 10);
+      if(*stop || digits[0] == '-' || errno)
+        fail(what);
+      return value;
+    }
+
+    void parseNode(SchemaDescription& schema, bool insideBits)
+    {
+      expectToken("missing node");
+      size_t index = schema.nodes.size();
+      schema.nodes.push_back(SchemaNode());
+      std::memset(&schema.nodes[index], 0, sizeof(SchemaNode));
+
+      if(is("multi") || is("bits"))
+      {
+        bool bitset = is("bits");
+        if(insideBits)
+          fail("only leaves go into bits");
+        unsigned long size = parseCount(bitset ? "bad byte count" : "bad repeat count");
+        if(!bitset && !size)
+          fail("bad repeat count");
+        expectToken("missing '{'");
+        if(!is("{"))
+          fail("missing '{'");
+
+        unsigned long usedBits = 0;
+        boost::uint32_t children = 0;
+        for(;;)
+        {
+          const char* before = pos;
+          size_t beforeLine = line;
+          expectToken("missing '}'");
+          if(is("}"))
+            break;
+          pos = before;
+          line = beforeLine;
+
+          unsigned long width = 0;
+          if(bitset)
+          {
+            width = parseCount("bad bit width");
+            usedBits += width;
+            if(!width || width > 64 || usedBits > size*8)
+              fail("bits do not fit");
+          }
+          size_t child = schema.nodes.size();
+          parseNode(schema, bitset);
+          schema.nodes[child].bits = boost::uint16_t(width);
+          ++children;
+        }
+
+        SchemaNode& node = schema.nodes[index];
+        node.kind = bitset ? SchemaBits : SchemaMulti;
+        node.size = size;
+        node.children = children;
+      }
+      else if(is("field") || is("tlv"))
+      {
+        bool tlv = is("tlv");
+        expectToken("missing queue name");
+        if(is("{") || is("}"))
+          fail("missing queue name");
+        SchemaNode& node = schema.nodes[index];
+        node.kind = tlv ? SchemaTlv : SchemaField;
+        node.nameOffset = boost::uint32_t(schema.names.size());
+        node.nameLength = boost::uint32_t(length);
+        schema.names.append(token, length);
+        if(!tlv)
+          node.encoding = parseEncoding();
+      }
+      else if(is("const"))
+      {
+        expectToken("missing constant");
+        std::string number(token, length);
+        char* stop;
+        errno = 0;
+        SchemaNode& node = schema.nodes[index];
+        if(number.find_first_of(".eE") == std::string::npos)
+        {
+          long value = std::strtol(number.c_str(), &stop, 10);
+          node.kind = SchemaConstLong;
+          node.constant = boost::uint64_t(value);
+        }
+        else
+        {
+          double value = std::strtod(number.c_str(), &stop);
+          node.kind = SchemaConstDouble;
+          std::memcpy(&node.constant, &value, sizeof(value));
+        }
+        if(*stop || errno)
+          fail("bad constant");
+      }
+      else
+        fail("unknown node");
+    }
+
+    // an optional encoding keyword after a field
+    boost::uint8_t parseEncoding()
+    {
+      static const char* const keywords[] = { "text", "varint", "zigzag", "fixed" };
+      const char* before = pos;
+      size_t beforeLine = line;
+      if(nextToken())
+        for(size_t i=0; i<sizeof(keywords)/sizeof(keywords[0]); ++i)
+          if(is(keywords[i]))
+            return boost::uint8_t(i);
+      pos = before;
+      line = beforeLine;
+      return 0;
+    }
+
+    const char* pos;
+    const char* end;
+    const char* token;
+    size_t length;
+    size_t line;
+};
+
+/*
+ * Checks nodes that did not come from the parser, a mapped image say, for
+ * what the parser ensures: known kinds and encodings, as many nodes below
+ * each multi and bits node as it claims children, only leaves inside bits
+ * and with widths that fit, repeat counts above 0, names inside the names
+ * buffer and exactly one top level node.  Walks the nodes without
+ * recursion, so deep trees cannot exhaust the stack.
+ */
+class SchemaValidator
+{
+public:
+    // the first problem found, 0 if there is none
+    static const char* findProblem(const SchemaNode* nodes, size_t count, size_t namesSize)
+    {
+      if(!count)
+        return "missing node";
+      std::vector<Open> open;
+      for(size_t i=0; i<count; ++i)
+      {
+        if(i && open.empty())
+          return "nodes after the top level node";
+        SchemaNode const& node = nodes[i];
+        Open* parent = open.empty() ? 0 : &open.back();
+        bool insideBits = parent && parent->bitset;
+
+        if(node.kind < SchemaMulti || node.kind > SchemaConstDouble)
+          return "unknown node";
+        if(node.encoding > 3 || (node.encoding && node.kind != SchemaField))
+          return "bad encoding";
+        bool container = node.kind == SchemaMulti || node.kind == SchemaBits;
+        if(insideBits)
+        {
+          if(container)
+            return "only leaves go into bits";
+          parent->usedBits += node.bits;
+          if(!node.bits || node.bits > 64 || parent->usedBits > parent->size*8)
+            return "bits do not fit";
+        }
+        else if(node.bits)
+          return "bit width outside bits";
+        if(node.kind == SchemaMulti && !node.size)
+          return "bad repeat count";
+        if(node.kind == SchemaBits && node.size > (~boost::uint64_t(0) >> 3))
+          return "bad byte count";
+        if((node.kind == SchemaField || node.kind == SchemaTlv)
+           && (!node.nameLength || boost::uint64_t(node.nameOffset) + node.nameLength > namesSize))
+          return "missing queue name";
+        if(!container && node.children)
+          return "children below a leaf";
+
+        if(parent)
+          --parent->remaining;
+        if(container)
+        {
+          Open opened = { node.children, node.kind == SchemaBits, node.size, 0 };
+          open.push_back(opened);
+        }
+        while(!open.empty() && !open.back().remaining)
+          open.pop_back();
+      }
+      return open.empty() ? 0 : "missing child nodes";
+    }
+
+private:
+    struct Open
+    {
+        boost::uint64_t remaining;
+        bool bitset;
+        boost::uint64_t size;
+        boost::uint64_t usedBits;
+    };
+};
+
+#endif
@@ -0,0 +1,167 @@
+// -*- c++ -*-
+#ifndef SCHEMAIMAGE_H
+#define SCHEMAIMAGE_H
+
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define SCHEMAIMAGE_MMAP 1
+#endif
+
+#include <boost/cstdint.hpp>
+
+#include "schema.h"
+
+/*
+ * A SchemaDescription saved as one binary image, so that a service can
+ * map it at startup instead of parsing and validating the text again:
+ *
+ *   a SchemaImageHeader, the SchemaNode records, the names buffer.
+ *
+ * The records are stored in the layout and byte order of the machine
+ * that saved them; the header records the version and the record size,
+ * and an image from a different layout is refused rather than converted.
+ * On load the nodes are checked like the parser checks the text, which
+ * is one pass over the records, so a corrupt image is refused as well.
+ */
+struct SchemaImageHeader
+{
+    char magic[8];
+    boost::uint32_t version;
+    boost::uint32_t nodeSize;
+    boost::uint64_t nodeCount;
+    boost::uint64_t namesSize;
+};
+
+class SchemaImage
+{
+public:
+    static const boost::uint32_t Version = 1;
+
+    static void save(SchemaDescription const& schema, std::string const& path)
+    {
+      SchemaImageHeader header;
+      std::memset(&header, 0, sizeof(header));
+      std::memcpy(header.magic, magic(), sizeof(header.magic));
+      header.version = Version;
+      header.nodeSize = sizeof(SchemaNode);
+      header.nodeCount = schema.nodes.size();
+      header.namesSize = schema.names.size();
+
+      std::ofstream output(path.c_str(), std::ios::binary | std::ios::trunc);
+      output.write(reinterpret_cast<const char*>(&header), sizeof(header));
+      if(!schema.nodes.empty())
+        output.write(reinterpret_cast<const char*>(&schema.nodes[0]), schema.nodes.size() * sizeof(SchemaNode));
+      output.write(schema.names.data(), schema.names.size());
+      output.close();
+      if(!output)
+        throw SchemaError("cannot write " + path);
+    }
+
+    // maps the image read-only, or reads it where there is no mmap
+    explicit SchemaImage(std::string const& path)
+    :data(0), size(0)
+    {
+#ifdef SCHEMAIMAGE_MMAP
+      int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+      if(fd < 0)
+        throw SchemaError("cannot open " + path);
+      struct stat status;
+      if(fstat(fd, &status) == 0 && status.st_size > 0)
+      {
+        size = size_t(status.st_size);
+        int flags = MAP_PRIVATE;
+#ifdef MAP_POPULATE
+        // the whole image is read right away by the loader
+        flags |= MAP_POPULATE;
+#endif
+        void* mapped = mmap(0, size, PROT_READ, flags, fd, 0);
+        data = mapped == MAP_FAILED ? 0 : static_cast<const char*>(mapped);
+      }
+      close(fd);
+      if(!data)
+        throw SchemaError("cannot map " + path);
+#else
+      std::ifstream input(path.c_str(), std::ios::binary);
+      if(!input)
+        throw SchemaError("cannot open " + path);
+      copy.assign(std::istreambuf_iterator<char>(input), std::istreambuf_iterator<char>());
+      size = copy.size();
+      data = copy.empty() ? 0 : &copy[0];
+#endif
+      try
+      {
+        check(path);
+      }
+      catch(...)
+      {
+        unmap();
+        throw;
+      }
+    }
+
+    ~SchemaImage()
+    {
+      unmap();
+    }
+
+    const SchemaNode* nodes() const
+    {
+      return reinterpret_cast<const SchemaNode*>(data + sizeof(SchemaImageHeader));
+    }
+
+    size_t nodeCount() const { return size_t(header().nodeCount); }
+    const char* names() const { return reinterpret_cast<const char*>(nodes() + nodeCount()); }
+    size_t namesSize() const { return size_t(header().namesSize); }
+
+private:
+    SchemaImage(SchemaImage const&);
+    SchemaImage& operator=(SchemaImage const&);
+
+    static const char* magic() { return "FVSCHEMA"; }
+
+    SchemaImageHeader const& header() const
+    {
+      return *reinterpret_cast<const SchemaImageHeader*>(data);
+    }
+
+    void check(std::string const& path) const
+    {
+      if(size < sizeof(SchemaImageHeader)
+         || std::memcmp(header().magic, magic(), sizeof(header().magic)) != 0
+         || header().version != Version
+         || header().nodeSize != sizeof(SchemaNode))
+        throw SchemaError("not a schema image of this build: " + path);
+      boost::uint64_t body = size - sizeof(SchemaImageHeader);
+      if(header().nodeCount > body / sizeof(SchemaNode)
+         || header().nodeCount * sizeof(SchemaNode) + header().namesSize != body)
+        throw SchemaError("truncated schema image: " + path);
+      if(const char* problem = SchemaValidator::findProblem(nodes(), nodeCount(), namesSize()))
+        throw SchemaError(std::string(problem) + " in schema image: " + path);
+    }
+
+    void unmap()
+    {
+#ifdef SCHEMAIMAGE_MMAP
+      if(data)
+        munmap(const_cast<char*>(data), size);
+#endif
+      data = 0;
+    }
+
+    const char* data;
+    size_t size;
+#ifndef SCHEMAIMAGE_MMAP
+    std::vector<char> copy;
+#endif
+};
+
+#endif
@@ -0,0 +1,311 @@
+// -*- c++ -*-
+#ifndef SERIALIZERPOOL_H
+#define SERIALIZERPOOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include <boost/shared_ptr.hpp>
+
+#include "streambufs.h"
+
+template<typename ValueType> class FieldValueBase;
+
+/*
+ * Drives update() and serializeTo() of many independent field trees, one
+ * per session, on a fixed set of worker threads.
+ *
+ * Every session has a home worker.  Its tree is built by a factory that
+ * runs on that worker, which is pinned to one CPU, so under the default
+ * first-touch policy the nodes, sources and queues the factory allocates
+ * come from the memory node of that CPU.  A batch runs each session for a
+ * number of records and hands its serialized bytes to the sink in one
+ * piece.  Workers take their own sessions first; a worker that runs out
+ * steals from the back of the longest remaining list, so a few hot
+ * sessions do not hold up a batch.  Stolen sessions stay with their home
+ * for the next batch.
+ *
+ * addSession() and runBatch() are meant to be called from one controlling
+ * thread; the sink is called on the worker that ran the session.  An
+ * exception from a tree or the sink ends the batch of that session, its
+ * records are dropped; the other sessions run to the end and runBatch()
+ * rethrows the first exception once they did.
+ */
+template<typename ValueType>
+class SerializerPool
+{
+public:
+    typedef FieldValueBase<ValueType> Tree;
+    typedef boost::shared_ptr<Tree> Tree_ptr;
+    typedef std::function<Tree_ptr ()> TreeFactory;
+    typedef std::function<void (size_t session, std::string const& records)> Sink;
+
+    // thrown by addSession() when the factory threw or returned no tree
+    struct BuildFailed : public std::exception {};
+
+    SerializerPool(size_t numWorkers, Sink recordSink, bool pinThreads = true)
+    :sink(recordSink), pin(pinThreads), stopping(false), round(0),
+     batchRecords(0), busyWorkers(0), stolen(0)
+    {
+      for(size_t w=0; w<numWorkers; ++w)
+        workers.push_back(boost::shared_ptr<Worker>(new Worker));
+      for(size_t w=0; w<numWorkers; ++w)
+        workers[w]->thread = std::thread(&SerializerPool::run, this, w);
+    }
+
+    ~SerializerPool()
+    {
+      {
+        std::lock_guard<std::mutex> lock(control);
+        stopping = true;
+      }
+      wake.notify_all();
+      for(size_t w=0; w<workers.size(); ++w)
+        workers[w]->thread.join();
+    }
+
+    size_t workerCount() const { return workers.size(); }
+    size_t sessionCount() const { return sessions.size(); }
+    size_t homeWorker(size_t session) const { return session % workers.size(); }
+    Tree& tree(size_t session) const { return *sessions[session]->tree; }
+
+    // sessions that ran on a worker other than their home in the last batch
+    size_t stolenSessions() const { return stolen; }
+
+    // Builds the tree of a new session on its home worker and returns the
+    // session id; homes are handed out round robin.
+    size_t addSession(TreeFactory factory)
+    {
+      std::unique_lock<std::mutex> lock(control);
+      size_t session = sessions.size();
+      sessions.push_back(boost::shared_ptr<Session>());
+      Worker& home = *workers[homeWorker(session)];
+      home.builds.push_back(std::make_pair(session, factory));
+      wake.notify_all();
+      done.wait(lock, [&]{ return sessions[session] || home.buildFailed; });
+      if(!sessions[session])
+      {
+        home.buildFailed = false;
+        sessions.pop_back();
+        throw BuildFailed();
+      }
+      return session;
+    }
+
+    // Runs every session for the given number of records and returns
+    // once all of them were handed to the sink.
+    void runBatch(size_t records)
+    {
+      std::unique_lock<std::mutex> lock(control);
+      for(size_t s=0; s<sessions.size(); ++s)
+        workers[homeWorker(s)]->pending.push_back(s);
+      batchRecords = records;
+      busyWorkers = workers.size();
+      stolen = 0;
+      ++round;
+      wake.notify_all();
+      done.wait(lock, [&]{ return busyWorkers == 0; });
+      if(failure)
+      {
+        std::exception_ptr first;
+        first.swap(failure);
+        std::rethrow_exception(first);
+      }
+    }
+
+private:
+    struct Session
+    {
+        explicit Session(Tree_ptr sessionTree)
+        :tree(sessionTree), buf(&records), output(&buf)
+        {
+        }
+
+        Tree_ptr tree;
+        std::string records;
+        StringAppendBuf buf;
+        std::ostream output;
+    };
+
+    struct Worker
+    {
+        Worker()
+        :buildFailed(false)
+        {
+        }
+
+        std::thread thread;
+        // guards pending, which other workers steal from
+        std::mutex mutex;
+        std::deque<size_t> pending;
+        // guarded by the pool's control mutex
+        std::deque<std::pair<size_t, TreeFactory> > builds;
+        bool buildFailed;
+    };
+
+    static void pinToCpu(size_t index)
+    {
+#ifdef __linux__
+      unsigned cpus = std::thread::hardware_concurrency();
+      if(!cpus)
+        return;
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      CPU_SET(index % cpus, &set);
+      // a restricted cpuset refuses this, the worker then just floats
+      pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+      (void)index;
+#endif
+    }
+
+    void run(size_t index)
+    {
+      if(pin)
+        pinToCpu(index);
+      Worker& self = *workers[index];
+      unsigned long seenRound = 0;
+
+      std::unique_lock<std::mutex> lock(control);
+      for(;;)
+      {
+        wake.wait(lock, [&]{ return stopping || !self.builds.empty() || round != seenRound; });
+        if(stopping)
+          return;
+
+        if(!self.builds.empty())
+        {
+          std::pair<size_t, TreeFactory> build = self.builds.front();
+          self.builds.pop_front();
+          lock.unlock();
+          boost::shared_ptr<Session> session;
+          try
+          {
+            Tree_ptr built = build.second();
+            if(built)
+              session.reset(new Session(built));
+          }
+          catch(...)
+          {
+          }
+          lock.lock();
+          if(session)
+            sessions[build.first] = session;
+          else
+            self.buildFailed = true;
+          done.notify_all();
+          continue;
+        }
+
+        seenRound = round;
+        size_t records = batchRecords;
+        lock.unlock();
+        runSessions(index, records);
+        lock.lock();
+        if(--busyWorkers == 0)
+          done.notify_all();
+      }
+    }
+
+    void runSessions(size_t index, size_t records)
+    {
+      size_t session;
+      while(takeOwn(index, session) || steal(index, session))
+      {
+        Session& s = *sessions[session];
+        try
+        {
+          // the size of the previous record, grown into once per batch
+          s.records.reserve(records * s.tree->serializedSize());
+          for(size_t r=0; r<records; ++r)
+          {
+            s.tree->update();
+            s.tree->serializeTo(s.output);
+          }
+          sink(session, s.records);
+        }
+        catch(...)
+        {
+          s.output.clear();
+          std::lock_guard<std::mutex> lock(control);
+          if(!failure)
+            failure = std::current_exception();
+        }
+        s.records.clear();
+      }
+    }
+
+    bool takeOwn(size_t index, size_t& session)
+    {
+      Worker& self = *workers[index];
+      std::lock_guard<std::mutex> lock(self.mutex);
+      if(self.pending.empty())
+        return false;
+      session = self.pending.front();
+      self.pending.pop_front();
+      return true;
+    }
+
+    bool steal(size_t index, size_t& session)
+    {
+      for(;;)
+      {
+        // the sizes are only a hint, the victim may drain meanwhile
+        size_t victim = workers.size();
+        size_t longest = 0;
+        for(size_t w=0; w<workers.size(); ++w)
+        {
+          if(w == index)
+            continue;
+          std::lock_guard<std::mutex> lock(workers[w]->mutex);
+          if(workers[w]->pending.size() > longest)
+          {
+            longest = workers[w]->pending.size();
+            victim = w;
+          }
+        }
+        if(victim == workers.size())
+          return false;
+
+        std::lock_guard<std::mutex> lock(workers[victim]->mutex);
+        if(workers[victim]->pending.empty())
+          continue;
+        session = workers[victim]->pending.back();
+        workers[victim]->pending.pop_back();
+        ++stolen;
+        return true;
+      }
+    }
+
+    Sink sink;
+    bool pin;
+    std::vector<boost::shared_ptr<Worker> > workers;
+    std::vector<boost::shared_ptr<Session> > sessions;
+
+    std::mutex control;
+    std::condition_variable wake;
+    std::condition_variable done;
+    bool stopping;
+    unsigned long round;
+    size_t batchRecords;
+    size_t busyWorkers;
+    // the first exception of the running batch
+    std::exception_ptr failure;
+    std::atomic<size_t> stolen;
+};
+
+#endif
@@ -0,0 +1,65 @@
+// -*- c++ -*-
+#ifndef STREAMBUFS_H
+#define STREAMBUFS_H
+
+#include <cstddef>
+#include <string>
+#include <streambuf>
+
+/*
+ * A stream buffer appending everything to a std::string.  Unlike
+ * std::stringbuf the target can be switched and cleared without
+ * giving up its capacity, so steady-state encoding does not allocate.
+ */
+class StringAppendBuf : public std::streambuf
+{
+public:
+    explicit StringAppendBuf(std::string* target = 0)
+    :target_(target)
+    {
+    }
+
+    void setTarget(std::string* target) { target_ = target; }
+    std::string* target() const { return target_; }
+
+protected:
+    int_type overflow(int_type c)
+    {
+      if(!traits_type::eq_int_type(c, traits_type::eof()))
+        target_->push_back(traits_type::to_char_type(c));
+      return traits_type::not_eof(c);
+    }
+
+    std::streamsize xsputn(const char* s, std::streamsize n)
+    {
+      target_->append(s, n);
+      return n;
+    }
+
+private:
+    std::string* target_;
+};
+
+/*
+ * A stream buffer writing into a fixed range of memory, for encoders
+ * that know an upper bound of their output up front.  Writing past the
+ * end fails the stream.
+ */
+class SpanBuf : public std::streambuf
+{
+public:
+    SpanBuf()
+    {
+    }
+
+    void setSpan(char* begin, size_t size) { setp(begin, begin + size); }
+    size_t written() const { return size_t(pptr() - pbase()); }
+
+protected:
+    int_type overflow(int_type)
+    {
+      return traits_type::eof();
+    }
+};
+
+#endif
@@ -0,0 +1,104 @@
+// -*- c++ -*-
+#ifndef STRINGTABLE_H
+#define STRINGTABLE_H
+
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+
+#include <boost/cstdint.hpp>
+#include <boost/variant.hpp>
+
+/*
+ * A string held in a StringTable: a 32-bit id plus the table's copy of the
+ * text, which stays put for the lifetime of the table.  Copying and
+ * comparing it never touches the text.
+ */
+struct InternedString
+{
+    InternedString()
+    :id(0), text(0)
+    {
+    }
+
+    InternedString(boost::uint32_t stringId, const std::string* stringText)
+    :id(stringId), text(stringText)
+    {
+    }
+
+    boost::uint32_t id;
+    const std::string* text;
+};
+
+// ids tell apart strings without a text, such as TlvDecoder's, and texts
+// the strings of different tables
+inline bool operator==(InternedString const& lhs, InternedString const& rhs)
+{
+    return lhs.id == rhs.id && lhs.text == rhs.text;
+}
+
+inline std::ostream& operator<<(std::ostream& output, InternedString const& value)
+{
+    if(value.text)
+      output << *value.text;
+    return output;
+}
+
+/*
+ * Maps strings to InternedStrings.  The table is split into shards with a
+ * lock each, so producers on different threads rarely contend; ids are
+ * handed out from one counter and start at 1.
+ */
+class StringTable
+{
+public:
+    StringTable()
+    :nextId(1)
+    {
+    }
+
+    InternedString intern(std::string const& text)
+    {
+      size_t hash = std::hash<std::string>()(text);
+      Shard& shard = shards[hash % NumShards];
+      std::lock_guard<std::mutex> lock(shard.mutex);
+      Map::iterator it = shard.strings.find(text);
+      if(it == shard.strings.end())
+        it = shard.strings.insert(Map::value_type(text, nextId++)).first;
+      return InternedString(it->second, &it->first);
+    }
+
+    size_t size() const { return nextId - 1; }
+
+private:
+    static const size_t NumShards = 16;
+
+    // node based, so the keys never move
+    typedef std::unordered_map<std::string, boost::uint32_t> Map;
+
+    struct Shard
+    {
+        std::mutex mutex;
+        Map strings;
+    };
+
+    Shard shards[NumShards];
+    std::atomic<boost::uint32_t> nextId;
+};
+
+// the text of a std::string or InternedString alternative, otherwise 0
+template<typename Variant>
+const std::string* stringValue(Variant const& value)
+{
+    if(const std::string* text = boost::get<std::string>(&value))
+      return text;
+    if(const InternedString* interned = boost::get<InternedString>(&value))
+      return interned->text;
+    return 0;
+}
+
+#endif
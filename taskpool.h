@@ -0,0 +1,135 @@
+// -*- c++ -*-
+#ifndef TASKPOOL_H
+#define TASKPOOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+ * A fixed set of threads for data parallel loops.  run() hands the
+ * indices of one loop out one at a time to the pool threads and to the
+ * calling thread, and returns when all of them are done.  One loop runs
+ * at a time.
+ */
+class TaskPool
+{
+public:
+    typedef std::function<void (size_t)> Task;
+
+    explicit TaskPool(size_t numThreads)
+    :task(0), count(0), next(0), done(0), busy(0), generation(0), stopping(false)
+    {
+      for(size_t t=0; t<numThreads; ++t)
+        threads.push_back(std::thread(&TaskPool::work, this));
+    }
+
+    ~TaskPool()
+    {
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+      }
+      wake.notify_all();
+      for(size_t t=0; t<threads.size(); ++t)
+        threads[t].join();
+    }
+
+    size_t threadCount() const { return threads.size(); }
+
+    // Calls task(i) for every i below numTasks and rethrows the first
+    // exception a task threw once all are done.
+    void run(size_t numTasks, Task const& loopTask)
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      // threads that woke up late for the previous loop find nothing to do
+      finished.wait(lock, [&]{ return busy == 0; });
+      task = &loopTask;
+      count = numTasks;
+      next = 0;
+      done = 0;
+      error = std::exception_ptr();
+      ++generation;
+      lock.unlock();
+      wake.notify_all();
+
+      runTasks(loopTask, numTasks);
+
+      lock.lock();
+      finished.wait(lock, [&]{ return done == count && busy == 0; });
+      task = 0;
+      if(error)
+        std::rethrow_exception(error);
+    }
+
+private:
+    TaskPool(TaskPool const&);
+    TaskPool& operator=(TaskPool const&);
+
+    void work()
+    {
+      unsigned long seen = 0;
+      std::unique_lock<std::mutex> lock(mutex);
+      for(;;)
+      {
+        wake.wait(lock, [&]{ return stopping || generation != seen; });
+        if(stopping)
+          return;
+        seen = generation;
+        ++busy;
+        const Task* loopTask = task;
+        size_t numTasks = count;
+        lock.unlock();
+        if(loopTask)
+          runTasks(*loopTask, numTasks);
+        lock.lock();
+        --busy;
+        finished.notify_all();
+      }
+    }
+
+    void runTasks(Task const& loopTask, size_t numTasks)
+    {
+      size_t ran = 0;
+      for(size_t i; (i = next++) < numTasks; ++ran)
+      {
+        try
+        {
+          loopTask(i);
+        }
+        catch(...)
+        {
+          std::lock_guard<std::mutex> lock(mutex);
+          if(!error)
+            error = std::current_exception();
+        }
+      }
+      if(ran)
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        done += ran;
+        if(done == count)
+          finished.notify_all();
+      }
+    }
+
+    std::vector<std::thread> threads;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable finished;
+    const Task* task;
+    size_t count;
+    std::atomic<size_t> next;
+    size_t done;
+    size_t busy;
+    unsigned long generation;
+    bool stopping;
+    std::exception_ptr error;
+};
+
+#endif
@@ -0,0 +1,141 @@
+// -*- c++ -*-
+#ifndef TEXTENCODER_H
+#define TEXTENCODER_H
+
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#if __cplusplus >= 201703L
+#include <charconv>
+#endif
+
+#include <boost/variant.hpp>
+
+/*
+ * Text formatting into raw buffers, without iostreams.  Integers come out
+ * exactly as operator<< prints them with default stream flags, doubles in
+ * the shortest form that reads back to the same value.
+ */
+class TextEncoder
+{
+public:
+    // enough for any long, any size_t and any double
+    static const size_t MaxChars = 32;
+
+    static char* formatUnsigned(unsigned long value, char* out)
+    {
+      char digits[24];
+      char* p = digits + sizeof(digits);
+      while(value >= 100)
+      {
+        const char* pair = digitPairs() + (value % 100) * 2;
+        value /= 100;
+        *--p = pair[1];
+        *--p = pair[0];
+      }
+      if(value >= 10)
+      {
+        const char* pair = digitPairs() + value * 2;
+        *--p = pair[1];
+        *--p = pair[0];
+      }
+      else
+        *--p = char('0' + value);
+
+      size_t length = digits + sizeof(digits) - p;
+      std::memcpy(out, p, length);
+      return out + length;
+    }
+
+    // the number of characters formatUnsigned()/formatLong() write
+    static size_t unsignedSize(unsigned long value)
+    {
+      size_t digits = 1;
+      while(value >= 10)
+      {
+        value /= 10;
+        ++digits;
+      }
+      return digits;
+    }
+
+    static size_t longSize(long value)
+    {
+      return value < 0 ? 1 + unsignedSize(0UL - (unsigned long)value) : unsignedSize(value);
+    }
+
+    static char* formatLong(long value, char* out)
+    {
+      unsigned long magnitude = value;
+      if(value < 0)
+      {
+        *out++ = '-';
+        magnitude = 0UL - magnitude;
+      }
+      return formatUnsigned(magnitude, out);
+    }
+
+    static char* formatDouble(double value, char* out)
+    {
+#if defined(__cpp_lib_to_chars) && __cpp_lib_to_chars >= 201611L
+      return std::to_chars(out, out + MaxChars, value).ptr;
+#else
+      // the shortest precision that survives the round trip
+      for(int precision=1; ; ++precision)
+      {
+        int length = std::snprintf(out, MaxChars, "%.*g", precision, value);
+        if(precision >= 17 || std::strtod(out, 0) == value)
+          return out + length;
+      }
+#endif
+    }
+
+    // true for the value types the visitor below can format
+    template<typename Variant>
+    static bool canFormat(Variant const& value)
+    {
+      return boost::get<long>(&value) || boost::get<double>(&value);
+    }
+
+    /*
+     * Formats long and double alternatives of a variant into a buffer of
+     * MaxChars; any other type throws boost::bad_get just like
+     * boost::get<long> did before.
+     */
+    class Visitor : public boost::static_visitor<char*>
+    {
+    public:
+        explicit Visitor(char* output)
+        :out(output)
+        {
+        }
+
+        char* operator()(long value) const { return formatLong(value, out); }
+        char* operator()(double value) const { return formatDouble(value, out); }
+
+        template<typename T>
+        char* operator()(T const&) const { throw boost::bad_get(); }
+
+    private:
+        char* out;
+    };
+
+private:
+    static const char* digitPairs()
+    {
+      return "00010203040506070809"
+             "10111213141516171819"
+             "20212223242526272829"
+             "30313233343536373839"
+             "40414243444546474849"
+             "50515253545556575859"
+             "60616263646566676869"
+             "70717273747576777879"
+             "80818283848586878889"
+             "90919293949596979899";
+    }
+};
+
+#endif
@@ -0,0 +1,259 @@
+// -*- c++ -*-
+#ifndef TLVCODEC_H
+#define TLVCODEC_H
+
+#include <cstring>
+#include <exception>
+#include <string>
+
+#include "dataqueue.h"
+#include "varint.h"
+
+/*
+ * Compact tag-length-value form of queue items: a tag byte, the payload
+ * length as varint, then the payload.
+ *
+ *   TlvLong        8 bytes, little endian
+ *   TlvDouble      8 bytes of the IEEE 754 value, little endian
+ *   TlvString      the bytes of the string
+ *   TlvInterned    the id as varint
+ *   TlvItemID      the id as varint, then the value as TLV
+ *   TlvItemIDList  the entry count as varint, then per entry the id as
+ *                  varint and the value as TLV
+ *
+ * Ids are written as the varint of their 32-bit two's complement.
+ */
+enum TlvTag
+{
+    TlvLong = 0x01,
+    TlvDouble = 0x02,
+    TlvString = 0x03,
+    TlvInterned = 0x04,
+    TlvItemID = 0x10,
+    TlvItemIDList = 0x11
+};
+
+class TlvEncoder
+{
+public:
+    static size_t encodedSize(QueueItem const& value)
+    {
+      if(const BaseItemID* item = boost::get<BaseItemID>(&value))
+        return framedSize(itemSize(*item));
+      if(const BaseItemIDList* list = boost::get<BaseItemIDList>(&value))
+        return framedSize(listPayloadSize(*list));
+      return baseSize(value);
+    }
+
+    // appends the TLV form of value to output
+    static void encode(QueueItem const& value, std::string& output)
+    {
+      size_t start = output.size();
+      output.resize(start + encodedSize(value));
+      char* pos = &output[start];
+
+      if(const BaseItemID* item = boost::get<BaseItemID>(&value))
+      {
+        pos = writeHeader(TlvItemID, itemSize(*item), pos);
+        writeItem(*item, pos);
+      }
+      else if(const BaseItemIDList* list = boost::get<BaseItemIDList>(&value))
+      {
+        pos = writeHeader(TlvItemIDList, listPayloadSize(*list), pos);
+        pos = Varint::encode(list->size(), pos);
+        for(BaseItemIDList::const_iterator it = list->begin(); it != list->end(); ++it)
+          pos = writeItem(*it, pos);
+      }
+      else
+        writeBase(value, pos);
+    }
+
+private:
+    static size_t framedSize(size_t payload)
+    {
+      return 1 + Varint::size(payload) + payload;
+    }
+
+    // the scalar helpers take a BaseItem or a QueueItem holding a base type
+    template<typename Variant>
+    static size_t basePayloadSize(Variant const& value)
+    {
+      if(const std::string* text = boost::get<std::string>(&value))
+        return text->size();
+      if(const InternedString* interned = boost::get<InternedString>(&value))
+        return Varint::size(interned->id);
+      return 8;
+    }
+
+    template<typename Variant>
+    static size_t baseSize(Variant const& value)
+    {
+      return framedSize(basePayloadSize(value));
+    }
+
+    static size_t itemSize(BaseItemID const& item)
+    {
+      return Varint::size(boost::uint32_t(item.first)) + baseSize(item.second);
+    }
+
+    static size_t listPayloadSize(BaseItemIDList const& list)
+    {
+      size_t size = Varint::size(list.size());
+      for(BaseItemIDList::const_iterator it = list.begin(); it != list.end(); ++it)
+        size += itemSize(*it);
+      return size;
+    }
+
+    static char* writeHeader(TlvTag tag, size_t payload, char* pos)
+    {
+      *pos++ = char(tag);
+      return Varint::encode(payload, pos);
+    }
+
+    static char* writeFixed(unsigned long long bits, char* pos)
+    {
+      for(int i=0; i<8; ++i)
+        *pos++ = char(bits >> (8*i));
+      return pos;
+    }
+
+    template<typename Variant>
+    static char* writeBase(Variant const& value, char* pos)
+    {
+      if(const long* number = boost::get<long>(&value))
+      {
+        pos = writeHeader(TlvLong, 8, pos);
+        return writeFixed((unsigned long long)*number, pos);
+      }
+      if(const double* number = boost::get<double>(&value))
+      {
+        unsigned long long bits;
+        std::memcpy(&bits, number, sizeof(bits));
+        pos = writeHeader(TlvDouble, 8, pos);
+        return writeFixed(bits, pos);
+      }
+      if(const InternedString* interned = boost::get<InternedString>(&value))
+      {
+        pos = writeHeader(TlvInterned, Varint::size(interned->id), pos);
+        return Varint::encode(interned->id, pos);
+      }
+      std::string const& text = boost::get<std::string>(value);
+      pos = writeHeader(TlvString, text.size(), pos);
+      std::memcpy(pos, text.data(), text.size());
+      return pos + text.size();
+    }
+
+    static char* writeItem(BaseItemID const& item, char* pos)
+    {
+      pos = Varint::encode(boost::uint32_t(item.first), pos);
+      return writeBase(item.second, pos);
+    }
+};
+
+/*
+ * Reads the TLV form back.  Interned strings come back as InternedStrings
+ * with their id only; mapping ids to texts is up to the reader.
+ */
+class TlvDecoder
+{
+public:
+    struct Malformed : public std::exception {};
+
+    static QueueItem decode(const char*& pos, const char* end)
+    {
+      unsigned char tag = readByte(pos, end);
+      const char* payloadEnd = payload(pos, end);
+      QueueItem value;
+      if(tag == TlvItemID)
+        value = readItem(pos, payloadEnd);
+      else if(tag == TlvItemIDList)
+      {
+        BaseItemIDList list;
+        unsigned long count = Varint::decode(pos, payloadEnd);
+        for(unsigned long i=0; i<count; ++i)
+          list.push_back(readItem(pos, payloadEnd));
+        value = list;
+      }
+      else
+        value = toQueueItem(readBase(tag, pos, payloadEnd));
+      if(pos != payloadEnd)
+        throw Malformed();
+      return value;
+    }
+
+private:
+    static unsigned char readByte(const char*& pos, const char* end)
+    {
+      if(pos == end)
+        throw Malformed();
+      return *pos++;
+    }
+
+    // reads the payload length and returns the end of the payload
+    static const char* payload(const char*& pos, const char* end)
+    {
+      unsigned long length = Varint::decode(pos, end);
+      if(length > size_t(end - pos))
+        throw Malformed();
+      return pos + length;
+    }
+
+    static unsigned long long readFixed(const char*& pos, const char* end)
+    {
+      if(end - pos < 8)
+        throw Malformed();
+      unsigned long long bits = 0;
+      for(int i=0; i<8; ++i)
+        bits |= (unsigned long long)(unsigned char)(*pos++) << (8*i);
+      return bits;
+    }
+
+    static BaseItem readBase(unsigned char tag, const char*& pos, const char* end)
+    {
+      switch(tag)
+      {
+      case TlvLong:
+        return BaseItem(long(readFixed(pos, end)));
+      case TlvDouble:
+        {
+          unsigned long long bits = readFixed(pos, end);
+          double number;
+          std::memcpy(&number, &bits, sizeof(number));
+          return BaseItem(number);
+        }
+      case TlvString:
+        {
+          std::string text(pos, end);
+          pos = end;
+          return BaseItem(text);
+        }
+      case TlvInterned:
+        return BaseItem(InternedString(boost::uint32_t(Varint::decode(pos, end)), 0));
+      }
+      throw Malformed();
+    }
+
+    static BaseItemID readItem(const char*& pos, const char* end)
+    {
+      int id = int(boost::uint32_t(Varint::decode(pos, end)));
+      unsigned char tag = readByte(pos, end);
+      const char* payloadEnd = payload(pos, end);
+      BaseItem value = readBase(tag, pos, payloadEnd);
+      if(pos != payloadEnd)
+        throw Malformed();
+      return BaseItemID(id, value);
+    }
+
+    static QueueItem toQueueItem(BaseItem const& value)
+    {
+      if(const long* number = boost::get<long>(&value))
+        return QueueItem(*number);
+      if(const double* number = boost::get<double>(&value))
+        return QueueItem(*number);
+      if(const InternedString* interned = boost::get<InternedString>(&value))
+        return QueueItem(*interned);
+      return QueueItem(boost::get<std::string>(value));
+    }
+};
+
+#endif
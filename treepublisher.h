@@ -0,0 +1,160 @@
+// -*- c++ -*-
+#ifndef TREEPUBLISHER_H
+#define TREEPUBLISHER_H
+
+#include <atomic>
+#include <cstddef>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include <boost/shared_ptr.hpp>
+
+template<typename ValueType> class FieldValueBase;
+
+/*
+ * Publishes the root of a field tree to serializer threads and lets it be
+ * replaced while they run, with epoch-based reclamation of the old roots.
+ *
+ * Each serializer thread registers a Reader once.  Entering a read
+ * section stores the current epoch in the reader's own cache line and
+ * loads the root pointer; leaving stores 0.  Neither takes a lock or
+ * touches a reference count.  publish() swaps the root and retires the
+ * old one with the epoch it was current in; reclaim() drops retired roots
+ * that no reader can still be looking at, that is once every reader is
+ * outside a section or entered it in a later epoch.
+ *
+ * publish(), reclaim() and registerReader() may be called from any
+ * thread and serialize on a mutex.  Publication does not make one tree
+ * safe for concurrent update()/serializeTo() calls; readers sharing a
+ * tree still need to agree on who drives it.
+ */
+template<typename ValueType>
+class TreePublisher
+{
+public:
+    typedef FieldValueBase<ValueType> Tree;
+    typedef boost::shared_ptr<Tree> Tree_ptr;
+
+    class Reader
+    {
+    public:
+        Reader()
+        :epoch(0)
+        {
+        }
+
+    private:
+        friend class TreePublisher;
+
+        // 0 outside a read section; padded against false sharing
+        alignas(64) std::atomic<unsigned long> epoch;
+        char padding[64 - sizeof(std::atomic<unsigned long>)];
+    };
+
+    // a read section as a scope
+    class Section
+    {
+    public:
+        Section(TreePublisher& treePublisher, Reader& sectionReader)
+        :publisher(treePublisher), reader(sectionReader), tree(publisher.enter(reader))
+        {
+        }
+
+        ~Section()
+        {
+          publisher.leave(reader);
+        }
+
+        Tree* get() const { return tree; }
+        Tree* operator->() const { return tree; }
+        Tree& operator*() const { return *tree; }
+
+    private:
+        Section(Section const&);
+        Section& operator=(Section const&);
+
+        TreePublisher& publisher;
+        Reader& reader;
+        Tree* tree;
+    };
+
+    explicit TreePublisher(Tree_ptr root)
+    :current(root.get()), epoch(1), currentRoot(root)
+    {
+    }
+
+    // the reader stays valid for the lifetime of the publisher
+    Reader& registerReader()
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      readers.push_back(boost::shared_ptr<Reader>(new Reader));
+      return *readers.back();
+    }
+
+    Tree* enter(Reader& reader)
+    {
+      // the epoch must be visible before the root is read, hence seq_cst
+      reader.epoch.store(epoch.load(std::memory_order_relaxed), std::memory_order_seq_cst);
+      return current.load(std::memory_order_seq_cst);
+    }
+
+    void leave(Reader& reader)
+    {
+      reader.epoch.store(0, std::memory_order_release);
+    }
+
+    // Makes root the tree readers get from now on; readers inside a
+    // section keep the tree they entered with.
+    void publish(Tree_ptr root)
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      current.store(root.get(), std::memory_order_seq_cst);
+      retired.push_back(std::make_pair(epoch.load(std::memory_order_relaxed), currentRoot));
+      currentRoot = root;
+      epoch.fetch_add(1, std::memory_order_seq_cst);
+    }
+
+    // Releases the retired roots no reader can see any more and returns
+    // the number still waiting.
+    size_t reclaim()
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      unsigned long oldest = epoch.load(std::memory_order_seq_cst);
+      for(size_t r=0; r<readers.size(); ++r)
+      {
+        unsigned long seen = readers[r]->epoch.load(std::memory_order_seq_cst);
+        if(seen && seen < oldest)
+          oldest = seen;
+      }
+      size_t kept = 0;
+      for(size_t i=0; i<retired.size(); ++i)
+      {
+        // a reader of epoch e may hold any root retired in epoch e or later
+        if(retired[i].first >= oldest)
+          retired[kept++] = retired[i];
+      }
+      retired.resize(kept);
+      return kept;
+    }
+
+    Tree_ptr root() const
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      return currentRoot;
+    }
+
+private:
+    TreePublisher(TreePublisher const&);
+    TreePublisher& operator=(TreePublisher const&);
+
+    std::atomic<Tree*> current;
+    std::atomic<unsigned long> epoch;
+
+    mutable std::mutex mutex;
+    Tree_ptr currentRoot;
+    std::vector<std::pair<unsigned long, Tree_ptr> > retired;
+    std::vector<boost::shared_ptr<Reader> > readers;
+};
+
+#endif
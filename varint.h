@@ -0,0 +1,191 @@
+// -*- c++ -*-
+#ifndef VARINT_H
+#define VARINT_H
+
+#include <cstddef>
+#include <exception>
+#include <ostream>
+#include <string>
+#include <vector>
+
+/*
+ * LEB128 variable length integers: seven bits per byte, least significant
+ * group first, the high bit set on all but the last byte.
+ */
+class Varint
+{
+public:
+    // thrown for input that ends inside a varint or overflows a long
+    struct Truncated : public std::exception {};
+
+    // enough for any unsigned long
+    static const size_t MaxBytes = 10;
+
+    static size_t size(unsigned long value)
+    {
+      size_t bytes = 1;
+      while(value >= 0x80)
+      {
+        value >>= 7;
+        ++bytes;
+      }
+      return bytes;
+    }
+
+    static char* encode(unsigned long value, char* out)
+    {
+      while(value >= 0x80)
+      {
+        *out++ = char(value | 0x80);
+        value >>= 7;
+      }
+      *out++ = char(value);
+      return out;
+    }
+
+    static unsigned long decode(const char*& pos, const char* end)
+    {
+      unsigned long value = 0;
+      for(unsigned shift=0; ; shift+=7)
+      {
+        if(pos == end || shift >= 64)
+          throw Truncated();
+        unsigned char byte = *pos++;
+        value |= (unsigned long)(byte & 0x7f) << shift;
+        if(!(byte & 0x80))
+          return value;
+      }
+    }
+};
+
+/*
+ * Maps signed to unsigned values so that small magnitudes of either sign
+ * become small numbers: 0, -1, 1, -2, 2 ... turn into 0, 1, 2, 3, 4 ...
+ */
+class ZigZag
+{
+public:
+    static unsigned long encode(long value)
+    {
+      return ((unsigned long)value << 1) ^ (unsigned long)(value >> (sizeof(long)*8 - 1));
+    }
+
+    static long decode(unsigned long value)
+    {
+      return long(value >> 1) ^ -long(value & 1);
+    }
+};
+
+/*
+ * Group varint for columns of 64-bit values: each group of four values
+ * starts with a tag byte holding a 2-bit length code per value, lowest
+ * bits first, for 1, 2, 4 or 8 little endian bytes.  The lengths of a
+ * group are known after one byte, so decoding needs no per-byte branches
+ * and lends itself to shuffle-table SIMD implementations.  A last
+ * incomplete group only carries the values present.
+ */
+class GroupVarint
+{
+public:
+    typedef Varint::Truncated Truncated;
+
+    static size_t maxSize(size_t count)
+    {
+      return (count + 3) / 4 + count * 8;
+    }
+
+    static char* encode(const unsigned long* values, size_t count, char* out)
+    {
+      for(size_t group=0; group<count; group+=4)
+      {
+        char* tag = out++;
+        unsigned char codes = 0;
+        for(size_t i=0; i<4 && group+i<count; ++i)
+        {
+          unsigned long value = values[group+i];
+          unsigned code = value < 0x100UL ? 0 : value < 0x10000UL ? 1 : value < 0x100000000UL ? 2 : 3;
+          codes |= code << (2*i);
+          for(size_t b=0; b<lengths()[code]; ++b)
+            *out++ = char(value >> (8*b));
+        }
+        *tag = char(codes);
+      }
+      return out;
+    }
+
+    // returns the position after the decoded values
+    static const char* decode(const char* in, const char* end, unsigned long* values, size_t count)
+    {
+      for(size_t group=0; group<count; group+=4)
+      {
+        if(in == end)
+          throw Truncated();
+        unsigned char codes = *in++;
+        for(size_t i=0; i<4 && group+i<count; ++i)
+        {
+          size_t length = lengths()[(codes >> (2*i)) & 3];
+          if(size_t(end - in) < length)
+            throw Truncated();
+          unsigned long value = 0;
+          for(size_t b=0; b<length; ++b)
+            value |= (unsigned long)(unsigned char)in[b] << (8*b);
+          values[group+i] = value;
+          in += length;
+        }
+      }
+      return in;
+    }
+
+private:
+    static const size_t* lengths()
+    {
+      static const size_t table[4] = { 1, 2, 4, 8 };
+      return table;
+    }
+};
+
+/*
+ * Batches of signed columns in group varint: the rows added are collected
+ * per column and written as
+ *
+ *   varint row count, varint column count, then per column
+ *   the zigzag encoded values of all rows as one GroupVarint run.
+ */
+class GroupVarintColumnEncoder
+{
+public:
+    explicit GroupVarintColumnEncoder(size_t numColumns)
+    :columns(numColumns)
+    {
+    }
+
+    size_t columnCount() const { return columns.size(); }
+    size_t rowCount() const { return columns.empty() ? 0 : columns[0].size(); }
+
+    void addRow(const long* values)
+    {
+      for(size_t c=0; c<columns.size(); ++c)
+        columns[c].push_back(ZigZag::encode(values[c]));
+    }
+
+    // writes the rows added so far as one batch and starts the next one
+    void writeTo(std::ostream& output)
+    {
+      size_t rows = rowCount();
+      buffer.resize(2*Varint::MaxBytes + columns.size() * GroupVarint::maxSize(rows));
+      char* begin = &buffer[0];
+      char* end = Varint::encode(columns.size(), Varint::encode(rows, begin));
+      for(size_t c=0; c<columns.size() && rows; ++c)
+        end = GroupVarint::encode(&columns[c][0], rows, end);
+      output.write(begin, end - begin);
+
+      for(size_t c=0; c<columns.size(); ++c)
+        columns[c].clear();
+    }
+
+private:
+    std::vector<std::vector<unsigned long> > columns;
+    std::string buffer;
+};
+
+#endif